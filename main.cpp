@@ -4,15 +4,57 @@
 #include "SDL_mixer.h"
 
 #include <iostream>
+#include <fstream>
 #include <vector>
+#include <algorithm>
+#include <map>
 #include <math.h>
 #include <stdlib.h> 
+#include <limits.h>
+#include <string.h>
 #include <time.h>   
+#include <dirent.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Build with -DCOUNT_ALLOCATIONS to get the heap allocations per frame printed along with the render time,
+// and the time the track, the assets and the first frame take to be ready after launch
+#ifdef COUNT_ALLOCATIONS
+#include <new>
+
+// Counted from every thread (traffic, rasterizer, asset and view workers allocate too)
+SDL_atomic_t allocationCount;
+
+unsigned long heapAllocations(void) {
+	return (unsigned int)SDL_AtomicGet(&allocationCount);
+}
+
+void * operator new(size_t size) {
+	void * pointer = malloc(size);
+	SDL_AtomicAdd(&allocationCount, 1);
+	if (pointer == NULL) throw std::bad_alloc();
+	return pointer;
+}
+
+void operator delete(void * pointer) throw() {
+	free(pointer);
+}
+#endif
 
 #define __PI 3.14159265358979323846
 #define __E	 2.71828
 
-#define FPS					15.0
+#define FPS					15.0				// default simulation ticks per second, rendering is not tied to it
 
 #define LENGTH_NONE			0
 #define LENGTH_SHORT		25
@@ -30,25 +72,31 @@
 #define CURVE_HARD			6
       
 
-void drawFilledTrapezium(SDL_Renderer* renderer, int poly[4][2], const SDL_Color color) {
-	int 	dy, dx, x1, x2;
-	float 	slopeLeft, slopeRight, cteLeft, cteRight;
+void trapeziumSlopes(int poly[4][2], float * slopeLeft, float * cteLeft, float * slopeRight, float * cteRight) {
+	int 	dy, dx;
 	// --
 	dx = poly[3][0] - poly[0][0];
 	dy = poly[3][1] - poly[0][1];
 	// std::cout << "dy: " << dy << " dx: " << dx << std::endl;
-	if (dy == 0) slopeLeft = 1.0f; else
-		if (dx == 0)  slopeLeft = 0.0f; else
-			slopeLeft = (float)(dy)/(float)(dx);
-	cteLeft = poly[0][1] - slopeLeft * poly[0][0];
+	if (dy == 0) *slopeLeft = 1.0f; else
+		if (dx == 0)  *slopeLeft = 0.0f; else
+			*slopeLeft = (float)(dy)/(float)(dx);
+	*cteLeft = poly[0][1] - *slopeLeft * poly[0][0];
 	dx = poly[2][0] - poly[1][0];
 	dy = poly[2][1] - poly[1][1];
 	// std::cout << "dy: " << dy << " dx: " << dx << std::endl;
-	if (dy == 0) slopeRight = 1.0; else
-		if (dx == 0)  slopeRight = 0.0; else
-			slopeRight = (float)(dy)/(float)(dx);
-	cteRight = poly[1][1] - slopeRight * poly[1][0];
-	// std::cout << "dy/dx: " << slopeLeft << " dy/dx: " << slopeRight << std::endl;
+	if (dy == 0) *slopeRight = 1.0; else
+		if (dx == 0)  *slopeRight = 0.0; else
+			*slopeRight = (float)(dy)/(float)(dx);
+	*cteRight = poly[1][1] - *slopeRight * poly[1][0];
+	// std::cout << "dy/dx: " << *slopeLeft << " dy/dx: " << *slopeRight << std::endl;
+}
+
+void drawFilledTrapezium(SDL_Renderer* renderer, int poly[4][2], const SDL_Color color) {
+	int 	x1, x2;
+	float 	slopeLeft, slopeRight, cteLeft, cteRight;
+	// --
+	trapeziumSlopes(poly, &slopeLeft, &cteLeft, &slopeRight, &cteRight);
 	SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);		
 	for (int i = poly[0][1]; i < poly[3][1]; i++) {
 		if (slopeLeft == 0.0)  x1 = poly[0][0]; else x1 = (i - cteLeft)/slopeLeft;
@@ -69,25 +117,137 @@ bool collision(float x1, float w1, float x2, float w2, float percent) {
 
 // -------------------------------------------------------------------------------------------------
 
-#include <sstream>
-#define SSTR( x ) static_cast< std::ostringstream & >( ( std::ostringstream() << std::dec << x ) ).str()
+// Text built on the stack, for the HUD to format numbers without string streams: hudText() << "LAP " << lap
+class hudText {
+	public:
+		hudText();
+		hudText & operator<<(const char * text);
+		hudText & operator<<(int value);
+		hudText & fixed(float value, int decimals);
+		operator const char * () const;
+	private:
+		static const int size = 48;
+		char text[size];
+		int  length;
+};
+
+hudText::hudText() {
+	this->length  = 0;
+	this->text[0] = '\0';
+}
+
+hudText & hudText::operator<<(const char * text) {
+	while ((*text != '\0') && (this->length < size - 1))
+		this->text[this->length++] = *text++;
+	this->text[this->length] = '\0';
+	return *this;
+}
+
+hudText & hudText::operator<<(int value) {
+	char 		 digits[12];
+	int 		 count = 0;
+	unsigned int magnitude = (value < 0) ? 0u - (unsigned int)value : (unsigned int)value;
+	// --
+	do {
+		digits[count++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude > 0);
+	if (value < 0)
+		digits[count++] = '-';
+	while ((count > 0) && (this->length < size - 1))
+		this->text[this->length++] = digits[--count];
+	this->text[this->length] = '\0';
+	return *this;
+}
+
+// value with decimals digits after the point, rounded
+hudText & hudText::fixed(float value, int decimals) {
+	long long scale = 1, scaled;
+	// --
+	for (int i = 0; i < decimals; i++) scale *= 10;
+	scaled = (long long)((value < 0 ? -value : value) * scale + 0.5);
+	if ((value < 0) && (scaled > 0))
+		*this << "-";
+	*this << (int)(scaled / scale);
+	if (decimals > 0) {
+		*this << ".";
+		for (long long digit = scale / 10; digit > 0; digit /= 10)
+			*this << (int)((scaled / digit) % 10);
+	}
+	return *this;
+}
+
+hudText::operator const char * () const {
+	return this->text;
+}
+
+// Glyph layouts of the fonts in images/font, every glyph sideX pixels apart in a single row.
+// ~ marks a glyph no character maps to.
+#define FONT_GLYPHS_ARCADE	"0123456789~ABCDEFGHIJKLMNOPQRSTUVWXYZ.!~ "
+#define FONT_GLYPHS_DIGITS	"0123456789"
+#define FONT_GLYPHS_LETTERS	"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+
+enum { FONT_SPEED, FONT_BLUE, FONT_GREEN, FONT_PINK, FONT_YELLOW_LARGE, NUM_FONTS };
+
+class fontFile {
+	public:
+		const char * filename;
+		int 		 sideX, sideY;
+		const char * glyphs;
+};
+
+const fontFile fontFiles[NUM_FONTS] = {
+	{ "./images/font/speedFont.png", 		9, 14, FONT_GLYPHS_DIGITS  },
+	{ "./images/font/blueFont.png",			9, 8,  FONT_GLYPHS_ARCADE  },
+	{ "./images/font/greenFont.png",		9, 8,  FONT_GLYPHS_ARCADE  },
+	{ "./images/font/pinkFont.png",			9, 8,  FONT_GLYPHS_ARCADE  },
+	{ "./images/font/yellowlargeFont.png",	8, 16, FONT_GLYPHS_LETTERS }
+};
 
+// print() only queues the text, flush() draws everything queued since the last flush in one
+// SDL_RenderGeometry call (one SDL_RenderCopy per glyph before SDL 2.0.18). Every print of a
+// frame is a run kept from one frame to the next: a run printed again with the same text at the
+// same place keeps its geometry, and when none changed the whole batch is submitted as it was.
+// Once the runs of a frame have been seen no more memory is taken.
 class spriteFont {
 	public:
-		spriteFont(SDL_Renderer* renderer, const char * filename, int sideX, int sideY);
+		spriteFont(SDL_Renderer* renderer, const char * filename, int sideX, int sideY, const char * glyphs = FONT_GLYPHS_ARCADE);
+		spriteFont(SDL_Texture * texture, int sideX, int sideY, const char * glyphs = FONT_GLYPHS_ARCADE);
 		~spriteFont();
-		print(SDL_Renderer* renderer, int x, int y, int w, int h, std::string text);
+		void print(SDL_Renderer* renderer, int x, int y, int w, int h, const char * text);
+		int  flush(SDL_Renderer* renderer);
 	private:
+		static const int maxRunLength = 48;		// longer text is cut
+		class run {
+			public:
+				int 	 x, y, w, h, length, quads;
+				char 	 text[maxRunLength + 1];
+				SDL_Rect sourceRect[maxRunLength], dstRect[maxRunLength];
+		};
 		SDL_Texture * texture = NULL;
-		int sideX, sideY;
+		int sideX, sideY, textureWidth, textureHeight;
+		int glyphX[128];						// source x of each character, -1 when not in the font
+		std::vector<run> runs;
+		int  used, lastUsed;
+		bool changed;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+		std::vector<SDL_Vertex> vertices;		// maxRunLength quads per run
+		std::vector<int> 		indices;
+#endif
+		void setup(int sideX, int sideY, const char * glyphs);
 };
 
-spriteFont::spriteFont(SDL_Renderer* renderer, const char * filename, int sideX, int sideY) {
+spriteFont::spriteFont(SDL_Renderer* renderer, const char * filename, int sideX, int sideY, const char * glyphs) {
     SDL_Surface * spriteSheet = IMG_Load(filename);
 	this->texture = SDL_CreateTextureFromSurface(renderer, spriteSheet); 
 	SDL_FreeSurface(spriteSheet);
-	this->sideX = sideX;
-	this->sideY = sideY;
+	this->setup(sideX, sideY, glyphs);
+}
+
+// Takes a texture already loaded, e.g. by the asset loader, and owns it from then on
+spriteFont::spriteFont(SDL_Texture * texture, int sideX, int sideY, const char * glyphs) {
+	this->texture = texture;
+	this->setup(sideX, sideY, glyphs);
 }
 
 spriteFont::~spriteFont() {
@@ -96,36 +256,826 @@ spriteFont::~spriteFont() {
 		this->texture = NULL;
 	}
 }
-  
-spriteFont::print(SDL_Renderer* renderer, int x, int y, int w, int h, std::string text) {
-	SDL_Rect sourceRect, dstRect;
-	char c;
-	for (int i = 0; i < text.length(); ++i) {
-		dstRect.x = x + i * w;
-		dstRect.y = y;
-		dstRect.w = w;
-		dstRect.h = h;
-
-		c =	text.at(i);
-
-		if ((c >= '0') && (c <= '9'))
-			sourceRect.x = (c - 48) * this->sideX;
-		else
-			if ((c >= 'A') && (c <= 'Z'))
-				sourceRect.x = (this->sideX * 11) + (c - 65) * (this->sideX);
+
+// Lower case letters are drawn with the upper case glyphs when the font has no others, characters
+// not in the font with its blank, if any
+void spriteFont::setup(int sideX, int sideY, const char * glyphs) {
+	this->sideX 		= sideX;
+	this->sideY 		= sideY;
+	this->used			= 0;
+	this->lastUsed		= 0;
+	this->changed		= true;
+	this->textureWidth	= 1;
+	this->textureHeight = 1;
+	if (this->texture != NULL)
+		SDL_QueryTexture(this->texture, NULL, NULL, &this->textureWidth, &this->textureHeight);
+	for (int c = 0; c < 128; c++)
+		this->glyphX[c] = -1;
+	for (int i = 0; glyphs[i] != '\0'; i++)
+		if (glyphs[i] != '~')
+			this->glyphX[glyphs[i] & 0x7F] = i * sideX;
+	for (int c = 'a'; c <= 'z'; c++)
+		if (this->glyphX[c] == -1)
+			this->glyphX[c] = this->glyphX[c - 'a' + 'A'];
+	for (int c = 0; c < 128; c++)
+		if (this->glyphX[c] == -1)
+			this->glyphX[c] = this->glyphX[' '];
+}
+
+void spriteFont::print(SDL_Renderer* renderer, int x, int y, int w, int h, const char * text) {
+	int length = 0;
+	// --
+	if (this->used == this->runs.size()) {
+		this->runs.push_back(run());
+		this->runs.back().length = -1;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+		this->vertices.resize(this->runs.size() * maxRunLength * 4);
+#endif
+	}
+	run & line = this->runs[this->used++];
+	while ((text[length] != '\0') && (length < maxRunLength)) length++;
+	if ((line.x == x) && (line.y == y) && (line.w == w) && (line.h == h) && (line.length == length) && (memcmp(line.text, text, length) == 0))
+		return;
+	// -- Changed, lay it out again
+	line.x 		= x;
+	line.y 		= y;
+	line.w 		= w;
+	line.h 		= h;
+	line.length = length;
+	line.quads	= 0;
+	memcpy(line.text, text, length);
+	line.text[length] = '\0';
+	for (int i = 0; i < length; i++) {
+		int source = ((unsigned char)text[i] < 128) ? this->glyphX[(int)text[i]] : this->glyphX[' '];
+		if (source < 0)
+			continue;
+		line.sourceRect[line.quads].x = source;
+		line.sourceRect[line.quads].y = 0;
+		line.sourceRect[line.quads].w = this->sideX;
+		line.sourceRect[line.quads].h = this->sideY;
+		line.dstRect[line.quads].x 	  = x + i * w;
+		line.dstRect[line.quads].y 	  = y;
+		line.dstRect[line.quads].w 	  = w;
+		line.dstRect[line.quads].h 	  = h;
+		line.quads++;
+	}
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	SDL_Vertex * vertex = &this->vertices[(this->used - 1) * maxRunLength * 4];
+	for (int i = 0; i < line.quads; i++, vertex += 4) {
+		const SDL_Rect & src = line.sourceRect[i], & dst = line.dstRect[i];
+		for (int corner = 0; corner < 4; corner++) {
+			int right  = (corner == 1) || (corner == 2),
+				bottom = (corner >= 2);
+			vertex[corner].position.x  = dst.x + right * dst.w;
+			vertex[corner].position.y  = dst.y + bottom * dst.h;
+			vertex[corner].tex_coord.x = (float)(src.x + right * src.w) / this->textureWidth;
+			vertex[corner].tex_coord.y = (float)(src.y + bottom * src.h) / this->textureHeight;
+			vertex[corner].color.r = vertex[corner].color.g = vertex[corner].color.b = vertex[corner].color.a = 0xFF;
+		}
+	}
+#endif
+	this->changed = true;
+}
+
+// Returns the draw calls it took
+int spriteFont::flush(SDL_Renderer* renderer) {
+	int drawCalls = 0;
+	// --
+	if (this->used != this->lastUsed)
+		this->changed = true;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	if (this->changed == true) {
+		this->indices.clear();
+		for (int n = 0; n < this->used; n++)
+			for (int i = 0, base = n * maxRunLength * 4; i < this->runs[n].quads; i++, base += 4) {
+				this->indices.push_back(base);		this->indices.push_back(base + 1);	this->indices.push_back(base + 2);
+				this->indices.push_back(base);		this->indices.push_back(base + 2);	this->indices.push_back(base + 3);
+			}
+	}
+	if (this->indices.size() > 0) {
+		SDL_RenderGeometry(renderer, this->texture, &this->vertices[0], this->vertices.size(), &this->indices[0], this->indices.size());
+		drawCalls = 1;
+	}
+#else
+	for (int n = 0; n < this->used; n++)
+		for (int i = 0; i < this->runs[n].quads; i++, drawCalls++)
+			SDL_RenderCopy(renderer, this->texture, &this->runs[n].sourceRect[i], &this->runs[n].dstRect[i]);
+#endif
+	this->lastUsed = this->used;
+	this->used	   = 0;
+	this->changed  = false;
+	return drawCalls;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// Time spent in the main phases of a frame, accumulated until whoever reports it reads and clears it
+enum { PHASE_INPUT, PHASE_UPDATE_CARS, PHASE_BACKGROUNDS, PHASE_COLLISION, PHASE_PROJECTION, PHASE_SEGMENTS, PHASE_SPRITES, PHASE_RASTER, PHASE_PRESENT, NUM_PHASES };
+
+const char * phaseNames[NUM_PHASES] = { "input", "updateCars", "backgrounds", "collision", "projection", "segments", "sprites", "raster", "present" };
+Uint64 		 phaseTicks[NUM_PHASES];
+
+// Trace lanes, the main thread being 0
+#define PROFILE_TRAFFIC_LANE	16
+#define PROFILE_RASTER_LANE		32
+#define PROFILE_VIEW_LANE		48
+
+// While enabled every timed phase is also kept as an event in a ring buffer, from any thread
+// (slots are claimed with an atomic add, no lock), for the F5 overlay and the Chrome trace
+// export (chrome://tracing or Perfetto). Disabled it costs a flag test per phase.
+class frameProfiler {
+	public:
+		frameProfiler();
+		void enable(bool on);
+		void record(int phase, Uint64 start, Uint64 end, int lane);
+		void endFrame(Uint64 frameTicks);
+		void render(SDL_Renderer * renderer, spriteFont & font, int x, int y);
+		bool exportTrace(const char * filename);
+		bool enabled;
+		int  drawCalls;
+	private:
+		class event {
+			public:
+				Uint64 start, end;
+				int	   phase, lane;
+		};
+		static const int 	ringSize	= 1 << 16;		// a power of two
+		static const int 	historySize	= 120;
+		std::vector<event> 	ring;
+		SDL_atomic_t 		written;
+		Uint64				frameHistory[historySize], phaseHistory[historySize][NUM_PHASES];
+		int					frames, lastDrawCalls;
+		unsigned long		lastAllocations, frameAllocations;
+};
+
+frameProfiler::frameProfiler() {
+	this->enabled		   = false;
+	this->drawCalls		   = 0;
+	this->frames		   = 0;
+	this->lastDrawCalls	   = 0;
+	this->lastAllocations  = 0;
+	this->frameAllocations = 0;
+	SDL_AtomicSet(&this->written, 0);
+}
+
+// The ring is only allocated the first time it is turned on
+void frameProfiler::enable(bool on) {
+	if ((on == true) && (this->ring.size() == 0))
+		this->ring.resize(ringSize);
+	this->enabled = on;
+}
+
+void frameProfiler::record(int phase, Uint64 start, Uint64 end, int lane) {
+	event & slot = this->ring[SDL_AtomicAdd(&this->written, 1) & (ringSize - 1)];
+	// --
+	slot.start = start;
+	slot.end   = end;
+	slot.phase = phase;
+	slot.lane  = lane;
+}
+
+// On the main thread once per frame: keeps the phase times for the overlay and starts them over
+void frameProfiler::endFrame(Uint64 frameTicks) {
+	int frame = this->frames++ % historySize;
+	// --
+	this->frameHistory[frame] = frameTicks;
+	for (int i = 0; i < NUM_PHASES; i++) {
+		this->phaseHistory[frame][i] = phaseTicks[i];
+		phaseTicks[i] = 0;
+	}
+	this->lastDrawCalls = this->drawCalls;
+	this->drawCalls		= 0;
+#ifdef COUNT_ALLOCATIONS
+	unsigned long total	   = heapAllocations();
+	this->frameAllocations = total - this->lastAllocations;
+	this->lastAllocations  = total;
+#endif
+}
+
+// Frame graph of the last historySize frames, stacked by phase (1 px per 100 us, the white line is
+// 60 fps), and last frame's breakdown with the same colours. The text is queued on font, it shows
+// when the font is flushed.
+void frameProfiler::render(SDL_Renderer * renderer, spriteFont & font, int x, int y) {
+	const SDL_Color colors[NUM_PHASES] = { {0x80, 0x80, 0x80, 0xFF}, {0xE0, 0x40, 0x40, 0xFF}, {0xE0, 0xA0, 0x40, 0xFF},
+										   {0xE0, 0xE0, 0x40, 0xFF}, {0x40, 0xE0, 0x40, 0xFF}, {0x40, 0xE0, 0xE0, 0xFF},
+										   {0x40, 0x80, 0xE0, 0xFF}, {0xA0, 0x40, 0xE0, 0xFF}, {0xE0, 0x40, 0xE0, 0xFF} };
+	const int	graphHeight = 200;
+	double		ticksPerUs	= SDL_GetPerformanceFrequency() / 1e6;
+	int 		last		= (this->frames - 1) % historySize,
+				top;
+	SDL_Rect	rect		= { x, y, 2 * historySize, graphHeight + 12 * (NUM_PHASES + 3) + 4 };
+	// --
+	if (this->frames == 0)
+		return;
+	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0xA0);
+	SDL_RenderFillRect(renderer, &rect);
+	for (int i = 0; (i < historySize) && (i < this->frames); i++) {
+		int frame = (this->frames - 1 - i) % historySize;
+		top = y + graphHeight;
+		for (int phase = 0; phase < NUM_PHASES; phase++) {
+			rect.h = this->phaseHistory[frame][phase] / ticksPerUs / 100;
+			if (rect.h > top - y) rect.h = top - y;
+			rect.x = x + 2 * (historySize - 1 - i);
+			rect.y = top - rect.h;
+			rect.w = 2;
+			top	  -= rect.h;
+			SDL_SetRenderDrawColor(renderer, colors[phase].r, colors[phase].g, colors[phase].b, colors[phase].a);
+			SDL_RenderFillRect(renderer, &rect);
+		}
+	}
+	SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
+	SDL_RenderDrawLine(renderer, x, y + graphHeight - 167, x + 2 * historySize, y + graphHeight - 167);
+
+	top = y + graphHeight + 4;
+	font.print(renderer, x + 14, top, 9, 8, hudText() << "frame " << (int)(this->frameHistory[last] / ticksPerUs) << " us");
+	for (int phase = 0; phase < NUM_PHASES; phase++) {
+		top += 12;
+		rect.x = x + 2;	rect.y = top;	rect.w = 8;	rect.h = 8;
+		SDL_SetRenderDrawColor(renderer, colors[phase].r, colors[phase].g, colors[phase].b, colors[phase].a);
+		SDL_RenderFillRect(renderer, &rect);
+		font.print(renderer, x + 14, top, 9, 8, hudText() << phaseNames[phase] << " " << (int)(this->phaseHistory[last][phase] / ticksPerUs));
+	}
+	font.print(renderer, x + 14, top + 12, 9, 8, hudText() << "draw calls " << this->lastDrawCalls);
+#ifdef COUNT_ALLOCATIONS
+	font.print(renderer, x + 14, top + 24, 9, 8, hudText() << "allocations " << (int)this->frameAllocations);
+#endif
+}
+
+// The events still in the ring as complete ("X") events, microseconds from the oldest one
+bool frameProfiler::exportTrace(const char * filename) {
+	int 	 last  = SDL_AtomicGet(&this->written),
+			 first = (last > ringSize) ? last - ringSize : 0;
+	Uint64	 base  = (last > first) ? this->ring[first & (ringSize - 1)].start : 0;
+	double	 ticksPerUs = SDL_GetPerformanceFrequency() / 1e6;
+	std::map<int, bool> lanes;
+	std::ofstream out(filename);
+	// --
+	if (!out)
+		return false;
+	for (int i = first; i < last; i++)
+		lanes[this->ring[i & (ringSize - 1)].lane] = true;
+	out << "{\"traceEvents\": [" << std::endl;
+	out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"main\"}}";
+	for (std::map<int, bool>::iterator lane = lanes.begin(); lane != lanes.end(); ++lane)
+		if (lane->first > 0)
+			out << "," << std::endl << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << lane->first << ", \"args\": {\"name\": \""
+				<< ((lane->first >= PROFILE_VIEW_LANE) ? "view " : ((lane->first >= PROFILE_RASTER_LANE) ? "raster " : "traffic ")) << lane->first % PROFILE_TRAFFIC_LANE << "\"}}";
+	for (int i = first; i < last; i++) {
+		const event & slot = this->ring[i & (ringSize - 1)];
+		out << "," << std::endl << "{\"name\": \"" << phaseNames[slot.phase] << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << slot.lane
+			<< ", \"ts\": " << (slot.start - base) / ticksPerUs << ", \"dur\": " << (slot.end - slot.start) / ticksPerUs << "}";
+	}
+	out << std::endl << "]}" << std::endl;
+	return true;
+}
+
+frameProfiler profiler;
+
+// Times a phase from construction to destruction, next() closing it and opening another in one go.
+// Only the main thread (lane 0) adds up phaseTicks, other lanes just leave trace events.
+class phaseTimer {
+	public:
+		phaseTimer(int phase, int lane = 0);
+		~phaseTimer();
+		void next(int phase);
+		void stop(void);
+	private:
+		int    phase, lane;
+		Uint64 start;
+};
+
+phaseTimer::phaseTimer(int phase, int lane) {
+	this->phase = phase;
+	this->lane	= lane;
+	this->start = SDL_GetPerformanceCounter();
+}
+
+phaseTimer::~phaseTimer() {
+	this->stop();
+}
+
+void phaseTimer::next(int phase) {
+	this->stop();
+	this->phase = phase;
+	this->start = SDL_GetPerformanceCounter();
+}
+
+void phaseTimer::stop(void) {
+	Uint64 end;
+	// --
+	if (this->phase < 0)
+		return;
+	end = SDL_GetPerformanceCounter();
+	if (this->lane == 0)
+		phaseTicks[this->phase] += end - this->start;
+	if (profiler.enabled == true)
+		profiler.record(this->phase, this->start, end, this->lane);
+	this->phase = -1;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// CPU backend for headless rendering. Road spans, sprites and backgrounds are recorded as commands
+// and rasterized straight into an ARGB8888 framebuffer. The screen is cut in bands of bandHeight
+// rows, every command is binned into the bands it touches in submission order (so the painter's
+// order and the hill clipping done before submitting are kept) and the bands are taken one by one
+// by a pool of SDL threads, the calling thread included. Each pixel is written by one thread only,
+// so the image is the same whatever the number of threads.
+// Sprites are sampled like SDL's scaled blitter (16.16 steps starting half a step in) and blended
+// with its formula, dst = src * a / 255 + dst * (255 - a) / 255, 4 pixels at a time with SSE2.
+enum { RASTER_SPRITES, RASTER_BACKGROUNDS, NUM_RASTER_IMAGES };
+
+class bandRasterizer {
+	public:
+		bandRasterizer();
+		void start(int numThreads);
+		void stop(void);
+		bool loadImage(int image, const char * filename);
+		void begin(int width, int height);
+		void setViewport(SDL_Rect rect);
+		void fill(int left, int top, int right, int bottom, const SDL_Color color);
+		void blit(int image, SDL_Rect spriteRect, SDL_Rect dstRect, bool flip, Uint8 alpha = 0xFF);
+		void flush(void);
+		void rasterize(int threads);
+		Uint32 checksum(void);
+		bool save(const char * filename);
+		bool enabled;
+		int  numThreads, width, height;
+		std::vector<Uint32> pixels;
+	private:
+		class command {
+			public:
+				SDL_Rect src, dst, clip;
+				Uint32	 color;			// alpha of blits
+				int		 image;			// -1 for fills
+				bool	 flip;
+		};
+		class slot {
+			public:
+				bandRasterizer * pool;
+				int 			 index;
+		};
+		static const int 			bandHeight = 32;
+		std::vector<command>		commands;
+		std::vector< std::vector<int> > bands;
+		SDL_Rect					view;
+		SDL_Surface *				images[NUM_RASTER_IMAGES];
+		std::vector<SDL_Thread *> 	threads;
+		std::vector<SDL_sem *>		wake;
+		std::vector<slot>			slots;
+		SDL_sem *					done;
+		SDL_atomic_t				nextBand;
+		bool 						quit;
+		void bin(command & cmd);
+		void drain(void);
+		void rasterBand(int band);
+		void fillSpan(Uint32 * __restrict__ row, int left, int right, Uint32 color);
+		void blitSpan(Uint32 * __restrict__ row, const Uint32 * __restrict__ source, int left, int right, Uint32 pos, Uint32 step, int direction);
+		void blitSpan(Uint32 * __restrict__ row, const Uint32 * __restrict__ source, int left, int right, Uint32 pos, Uint32 step, int direction, Uint32 alpha);
+		static int work(void * data);
+};
+
+bandRasterizer::bandRasterizer() {
+	this->enabled	 = false;
+	this->numThreads = 1;
+	this->width		 = 0;
+	this->height	 = 0;
+	this->done		 = NULL;
+	this->quit		 = false;
+	for (int i = 0; i < NUM_RASTER_IMAGES; i++)
+		this->images[i] = NULL;
+	SDL_AtomicSet(&this->nextBand, 0);
+}
+
+void bandRasterizer::start(int numThreads) {
+	this->stop();
+	this->numThreads = (numThreads < 1) ? 1 : numThreads;
+	this->quit		 = false;
+	this->done		 = SDL_CreateSemaphore(0);
+	this->slots.resize(this->numThreads);
+	for (int i = 1; i < this->numThreads; i++) {
+		this->slots[i].pool  = this;
+		this->slots[i].index = i;
+		this->wake.push_back(SDL_CreateSemaphore(0));
+		this->threads.push_back(SDL_CreateThread(bandRasterizer::work, "raster", &this->slots[i]));
+	}
+}
+
+void bandRasterizer::stop(void) {
+	this->quit = true;
+	for (int i = 0; i < this->threads.size(); i++)
+		SDL_SemPost(this->wake[i]);
+	for (int i = 0; i < this->threads.size(); i++) {
+		SDL_WaitThread(this->threads[i], NULL);
+		SDL_DestroySemaphore(this->wake[i]);
+	}
+	this->threads.clear();
+	this->wake.clear();
+	if (this->done != NULL) {
+		SDL_DestroySemaphore(this->done);
+		this->done = NULL;
+	}
+	this->numThreads = 1;
+}
+
+int bandRasterizer::work(void * data) {
+	slot * worker = (slot *)data;
+	while (1) {
+		SDL_SemWait(worker->pool->wake[worker->index - 1]);
+		if (worker->pool->quit == true)
+			return 0;
+		Uint64 start = SDL_GetPerformanceCounter();
+		worker->pool->drain();
+		if (profiler.enabled == true)
+			profiler.record(PHASE_RASTER, start, SDL_GetPerformanceCounter(), PROFILE_RASTER_LANE + worker->index);
+		SDL_SemPost(worker->pool->done);
+	}
+}
+
+// Same files as the textures, kept in memory as ARGB8888 surfaces
+bool bandRasterizer::loadImage(int image, const char * filename) {
+	SDL_Surface * surface = IMG_Load(filename);
+	// --
+	if (surface == NULL)
+		return false;
+	if (this->images[image] != NULL)
+		SDL_FreeSurface(this->images[image]);
+	this->images[image] = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+	SDL_FreeSurface(surface);
+	return (this->images[image] != NULL);
+}
+
+void bandRasterizer::begin(int width, int height) {
+	if ((width != this->width) || (height != this->height)) {
+		this->width  = width;
+		this->height = height;
+		this->pixels.resize(width * height);
+		this->bands.resize((height + bandHeight - 1) / bandHeight);
+	}
+	this->commands.clear();
+	for (int i = 0; i < this->bands.size(); i++)
+		this->bands[i].clear();
+	this->view.x = 0;		this->view.w = width;
+	this->view.y = 0;		this->view.h = height;
+}
+
+// Whatever comes next is drawn relative to rect and clipped by it, like SDL_RenderSetViewport.
+// begin() sets the whole frame back.
+void bandRasterizer::setViewport(SDL_Rect rect) {
+	this->view = rect;
+}
+
+void bandRasterizer::bin(command & cmd) {
+	int first, last;
+	// --
+	cmd.dst.x += this->view.x;
+	cmd.dst.y += this->view.y;
+	cmd.clip   = this->view;
+	if (cmd.clip.x < 0) { cmd.clip.w += cmd.clip.x; cmd.clip.x = 0; }
+	if (cmd.clip.y < 0) { cmd.clip.h += cmd.clip.y; cmd.clip.y = 0; }
+	if (cmd.clip.x + cmd.clip.w > this->width)	cmd.clip.w = this->width - cmd.clip.x;
+	if (cmd.clip.y + cmd.clip.h > this->height) cmd.clip.h = this->height - cmd.clip.y;
+	if ((cmd.dst.w <= 0) || (cmd.dst.h <= 0) || (cmd.dst.x >= cmd.clip.x + cmd.clip.w) || (cmd.dst.x + cmd.dst.w <= cmd.clip.x) ||
+		(cmd.dst.y >= cmd.clip.y + cmd.clip.h) || (cmd.dst.y + cmd.dst.h <= cmd.clip.y))
+		return;
+	first = ((cmd.dst.y < cmd.clip.y) ? cmd.clip.y : cmd.dst.y) / bandHeight;
+	last  = ((cmd.dst.y + cmd.dst.h > cmd.clip.y + cmd.clip.h) ? cmd.clip.y + cmd.clip.h - 1 : cmd.dst.y + cmd.dst.h - 1) / bandHeight;
+	this->commands.push_back(cmd);
+	for (int band = first; band <= last; band++)
+		this->bands[band].push_back(this->commands.size() - 1);
+}
+
+void bandRasterizer::fill(int left, int top, int right, int bottom, const SDL_Color color) {
+	command cmd;
+	// --
+	if (color.a == 0)
+		return;
+	cmd.dst.x = left;	cmd.dst.w = right - left;
+	cmd.dst.y = top;	cmd.dst.h = bottom - top;
+	cmd.color = (color.a << 24) | (color.r << 16) | (color.g << 8) | color.b;
+	cmd.image = -1;
+	cmd.flip  = false;
+	this->bin(cmd);
+}
+
+void bandRasterizer::blit(int image, SDL_Rect spriteRect, SDL_Rect dstRect, bool flip, Uint8 alpha) {
+	command 	  cmd;
+	SDL_Surface * surface = this->images[image];
+	// --
+	if (surface == NULL)
+		return;
+	// Source rects are kept inside the image so sampling never reads out of it
+	if (spriteRect.x < 0) { spriteRect.w += spriteRect.x; spriteRect.x = 0; }
+	if (spriteRect.y < 0) { spriteRect.h += spriteRect.y; spriteRect.y = 0; }
+	if (spriteRect.x + spriteRect.w > surface->w) spriteRect.w = surface->w - spriteRect.x;
+	if (spriteRect.y + spriteRect.h > surface->h) spriteRect.h = surface->h - spriteRect.y;
+	if ((spriteRect.w <= 0) || (spriteRect.h <= 0))
+		return;
+	cmd.src   = spriteRect;
+	cmd.dst   = dstRect;
+	cmd.color = alpha;
+	cmd.image = image;
+	cmd.flip  = flip;
+	this->bin(cmd);
+}
+
+static inline Uint32 div255(Uint32 x) {
+	x += 1;
+	return (x + (x >> 8)) >> 8;
+}
+
+static inline Uint32 blendPixel(Uint32 src, Uint32 dst) {
+	Uint32 a = src >> 24;
+	// --
+	return 0xFF000000 |
+		   ((div255(((src >> 16) & 0xFF) * a) + div255(((dst >> 16) & 0xFF) * (255 - a))) << 16) |
+		   ((div255(((src >>  8) & 0xFF) * a) + div255(((dst >>  8) & 0xFF) * (255 - a))) <<  8) |
+		    (div255(( src		 & 0xFF) * a) + div255(( dst		 & 0xFF) * (255 - a)));
+}
+
+#ifdef __SSE2__
+static inline __m128i div255x8(__m128i x) {
+	x = _mm_add_epi16(x, _mm_set1_epi16(1));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// blendPixel on 4 pixels, channels widened to 16 bits (the largest product, 255 * 255, fits)
+static inline __m128i blendPixels(__m128i src, __m128i dst) {
+	const __m128i zero  = _mm_setzero_si128(),
+				  full  = _mm_set1_epi16(255);
+	__m128i srcLo = _mm_unpacklo_epi8(src, zero), srcHi = _mm_unpackhi_epi8(src, zero),
+			dstLo = _mm_unpacklo_epi8(dst, zero), dstHi = _mm_unpackhi_epi8(dst, zero),
+			aLo	  = _mm_shufflehi_epi16(_mm_shufflelo_epi16(srcLo, 0xFF), 0xFF),
+			aHi	  = _mm_shufflehi_epi16(_mm_shufflelo_epi16(srcHi, 0xFF), 0xFF);
+	srcLo = _mm_add_epi16(div255x8(_mm_mullo_epi16(srcLo, aLo)), div255x8(_mm_mullo_epi16(dstLo, _mm_sub_epi16(full, aLo))));
+	srcHi = _mm_add_epi16(div255x8(_mm_mullo_epi16(srcHi, aHi)), div255x8(_mm_mullo_epi16(dstHi, _mm_sub_epi16(full, aHi))));
+	return _mm_or_si128(_mm_packus_epi16(srcLo, srcHi), _mm_set1_epi32(0xFF000000));
+}
+#endif
+
+void bandRasterizer::fillSpan(Uint32 * __restrict__ row, int left, int right, Uint32 color) {
+	int x = left;
+	// --
+	if ((color >> 24) == 0xFF) {
+#ifdef __SSE2__
+		__m128i colors = _mm_set1_epi32(color);
+		for (; x + 4 <= right; x += 4)
+			_mm_storeu_si128((__m128i *)(row + x), colors);
+#endif
+		for (; x < right; x++)
+			row[x] = color;
+		return;
+	}
+#ifdef __SSE2__
+	__m128i colors = _mm_set1_epi32(color);
+	for (; x + 4 <= right; x += 4)
+		_mm_storeu_si128((__m128i *)(row + x), blendPixels(colors, _mm_loadu_si128((__m128i *)(row + x))));
+#endif
+	for (; x < right; x++)
+		row[x] = blendPixel(color, row[x]);
+}
+
+// Pixel x of the row samples source[direction * (pos >> 16)], pos growing by step each pixel
+void bandRasterizer::blitSpan(Uint32 * __restrict__ row, const Uint32 * __restrict__ source, int left, int right, Uint32 pos, Uint32 step, int direction) {
+	int 	x = left;
+	Uint32	color;
+	// --
+#ifdef __SSE2__
+	const __m128i alpha = _mm_set1_epi32(0xFF000000);
+	for (; x + 4 <= right; x += 4, pos += 4 * step) {
+		__m128i colors = _mm_set_epi32(source[direction * (int)((pos + 3 * step) >> 16)], source[direction * (int)((pos + 2 * step) >> 16)],
+									   source[direction * (int)((pos + step) >> 16)], 	  source[direction * (int)(pos >> 16)]);
+		int opaque = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(colors, alpha), alpha)),
+			clear  = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(colors, alpha), _mm_setzero_si128()));
+		if (opaque == 0xFFFF)
+			_mm_storeu_si128((__m128i *)(row + x), colors);
+		else if (clear != 0xFFFF)
+			_mm_storeu_si128((__m128i *)(row + x), blendPixels(colors, _mm_loadu_si128((__m128i *)(row + x))));
+	}
+#endif
+	for (; x < right; x++, pos += step) {
+		color = source[direction * (int)(pos >> 16)];
+		if ((color >> 24) == 0xFF)
+			row[x] = color;
+		else if ((color >> 24) != 0)
+			row[x] = blendPixel(color, row[x]);
+	}
+}
+
+// Translucent sprites, every pixel's alpha scaled by alpha first like SDL's alpha mod; only ghosts
+// are drawn this way so it goes a pixel at a time
+void bandRasterizer::blitSpan(Uint32 * __restrict__ row, const Uint32 * __restrict__ source, int left, int right, Uint32 pos, Uint32 step, int direction, Uint32 alpha) {
+	Uint32 color, a;
+	// --
+	for (int x = left; x < right; x++, pos += step) {
+		color = source[direction * (int)(pos >> 16)];
+		a	  = div255((color >> 24) * alpha);
+		if (a != 0)
+			row[x] = blendPixel((color & 0x00FFFFFF) | (a << 24), row[x]);
+	}
+}
+
+void bandRasterizer::rasterBand(int band) {
+	int top	   = band * bandHeight,
+		bottom = (top + bandHeight < this->height) ? top + bandHeight : this->height;
+	// --
+	for (int i = 0; i < this->bands[band].size(); i++) {
+		const command & cmd = this->commands[this->bands[band][i]];
+		int left  = (cmd.dst.x > cmd.clip.x) ? cmd.dst.x : cmd.clip.x,
+			right = (cmd.dst.x + cmd.dst.w < cmd.clip.x + cmd.clip.w) ? cmd.dst.x + cmd.dst.w : cmd.clip.x + cmd.clip.w,
+			first = (cmd.dst.y > top) ? cmd.dst.y : top,
+			last  = (cmd.dst.y + cmd.dst.h < bottom) ? cmd.dst.y + cmd.dst.h : bottom;
+		if (first < cmd.clip.y) 			 first = cmd.clip.y;
+		if (last > cmd.clip.y + cmd.clip.h) last  = cmd.clip.y + cmd.clip.h;
+		if (cmd.image < 0) {
+			for (int y = first; y < last; y++)
+				this->fillSpan(&this->pixels[y * this->width], left, right, cmd.color);
+			continue;
+		}
+		const SDL_Surface * surface = this->images[cmd.image];
+		Uint32 stepX = ((Uint64)cmd.src.w << 16) / cmd.dst.w,
+			   stepY = ((Uint64)cmd.src.h << 16) / cmd.dst.h,
+			   posX  = stepX / 2 + stepX * (left - cmd.dst.x);
+		int    column = cmd.src.x + ((cmd.flip == true) ? cmd.src.w - 1 : 0);
+		for (int y = first; y < last; y++) {
+			const Uint32 * source = (const Uint32 *)((const Uint8 *)surface->pixels + (cmd.src.y + ((stepY / 2 + stepY * (y - cmd.dst.y)) >> 16)) * surface->pitch) + column;
+			if (cmd.color == 0xFF)
+				this->blitSpan(&this->pixels[y * this->width], source, left, right, posX, stepX, (cmd.flip == true) ? -1 : 1);
 			else
-				sourceRect.x = this->sideX * 40;
-		
-		sourceRect.y = 0;
-		sourceRect.w = this->sideX;
-		sourceRect.h = this->sideY;
-		
-		SDL_RenderCopy(renderer, this->texture, &sourceRect, &dstRect);		
-	}		
+				this->blitSpan(&this->pixels[y * this->width], source, left, right, posX, stepX, (cmd.flip == true) ? -1 : 1, cmd.color);
+		}
+	}
+}
+
+// Bands are taken in order through an atomic counter, so a busy band does not hold up the others
+void bandRasterizer::drain(void) {
+	int band;
+	// --
+	while ((band = SDL_AtomicAdd(&this->nextBand, 1)) < this->bands.size())
+		this->rasterBand(band);
+}
+
+// Draws the commands recorded since begin() with up to threads threads of the pool; they are kept,
+// so the same frame can be drawn again
+void bandRasterizer::rasterize(int threads) {
+	if (threads > this->numThreads) threads = this->numThreads;
+	SDL_AtomicSet(&this->nextBand, 0);
+	for (int i = 1; i < threads; i++)
+		SDL_SemPost(this->wake[i - 1]);
+	this->drain();
+	for (int i = 1; i < threads; i++)
+		SDL_SemWait(this->done);
+}
+
+void bandRasterizer::flush(void) {
+	this->rasterize(this->numThreads);
+}
+
+Uint32 bandRasterizer::checksum(void) {
+	Uint32 checksum = 0;
+	// --
+	for (int i = 0; i < this->pixels.size(); i++)
+		checksum = checksum * 31 + (this->pixels[i] & 0xFFFFFF);
+	return checksum;
+}
+
+bool bandRasterizer::save(const char * filename) {
+	SDL_Surface * surface = SDL_CreateRGBSurfaceWithFormatFrom(&this->pixels[0], this->width, this->height, 32, this->width * 4, SDL_PIXELFORMAT_ARGB8888);
+	bool saved = (surface != NULL) && (SDL_SaveBMP(surface, filename) == 0);
+	// --
+	SDL_FreeSurface(surface);
+	return saved;
+}
+
+bandRasterizer rasterizer;
+
+// -------------------------------------------------------------------------------------------------
+
+// Collects every trapezium of the visible road (grass, rumbles, road and lanes) and submits
+// them all in one SDL_RenderGeometry call per frame. Trapezia are split in the same one pixel high
+// spans drawFilledTrapezium draws with SDL_RenderDrawLine, so both paths are pixel identical.
+// Needs SDL 2.0.18 or later; with older headers it always draws line by line. With the CPU
+// rasterizer enabled the same spans go to it instead.
+class roadBatch {
+	public:
+		roadBatch();
+		void begin(SDL_Renderer* renderer, int width, int height);
+		void addTrapezium(int poly[4][2], const SDL_Color color);
+		void flush(void);
+		bool batched;
+	private:
+		SDL_Renderer * renderer;
+		int width, height;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+		std::vector<SDL_Vertex> vertices;
+		std::vector<int> 		indices;
+#endif
+		void addQuad(int left, int top, int right, int bottom, const SDL_Color color);
+};
+
+roadBatch::roadBatch() {
+	this->renderer	= NULL;
+	this->width 	= 0;
+	this->height 	= 0;
+	this->batched	= SDL_VERSION_ATLEAST(2, 0, 18);
+}
+
+void roadBatch::begin(SDL_Renderer* renderer, int width, int height) {
+	this->renderer	= renderer;
+	this->width		= width;
+	this->height	= height;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	this->vertices.clear();
+	this->indices.clear();
+#else
+	this->batched	= false;
+#endif
+}
+
+void roadBatch::addQuad(int left, int top, int right, int bottom, const SDL_Color color) {
+	// -- Off screen parts are dropped here instead of by the rasterizer
+	if (left  < 0) 				left   = 0;
+	if (right > this->width) 	right  = this->width;
+	if (top   < 0) 				top    = 0;
+	if (bottom > this->height) 	bottom = this->height;
+	if ((left >= right) || (top >= bottom))
+		return;
+	if (rasterizer.enabled == true) {
+		rasterizer.fill(left, top, right, bottom, color);
+		return;
+	}
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	SDL_Vertex vertex;
+	int base = this->vertices.size();
+	// --
+	vertex.color		= color;
+	vertex.tex_coord.x	= 0;
+	vertex.tex_coord.y	= 0;
+	vertex.position.x = left;	vertex.position.y = top;		this->vertices.push_back(vertex);
+	vertex.position.x = right;	vertex.position.y = top;		this->vertices.push_back(vertex);
+	vertex.position.x = right;	vertex.position.y = bottom;		this->vertices.push_back(vertex);
+	vertex.position.x = left;	vertex.position.y = bottom;		this->vertices.push_back(vertex);
+	this->indices.push_back(base);		this->indices.push_back(base + 1);	this->indices.push_back(base + 2);
+	this->indices.push_back(base);		this->indices.push_back(base + 2);	this->indices.push_back(base + 3);
+#endif
+}
+
+void roadBatch::addTrapezium(int poly[4][2], const SDL_Color color) {
+	if ((this->batched == false) && (rasterizer.enabled == false)) {
+		drawFilledTrapezium(this->renderer, poly, color);
+		profiler.drawCalls += (poly[3][1] > poly[0][1]) ? poly[3][1] - poly[0][1] : 0;		// one line per row
+		return;
+	}
+	int 	x1, x2, top, bottom;
+	float 	slopeLeft, slopeRight, cteLeft, cteRight;
+	// --
+	trapeziumSlopes(poly, &slopeLeft, &cteLeft, &slopeRight, &cteRight);
+	top 	= (poly[0][1] < 0) ? 0 : poly[0][1];
+	bottom	= (poly[3][1] > this->height) ? this->height : poly[3][1];
+	for (int i = top; i < bottom; i++) {
+		if (slopeLeft == 0.0)  x1 = poly[0][0]; else x1 = (i - cteLeft)/slopeLeft;
+		if (slopeRight == 0.0) x2 = poly[1][0]; else x2 = (i - cteRight)/slopeRight;
+		// SDL_RenderDrawLine includes both end points whatever their order
+		if (x1 <= x2)
+			this->addQuad(x1, i, x2 + 1, i + 1, color);
+		else
+			this->addQuad(x2, i, x1 + 1, i + 1, color);
+	}
+}
+
+void roadBatch::flush(void) {
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	if ((this->batched == true) && (this->vertices.size() > 0)) {
+		// Untextured geometry uses the draw blend mode, opaque colors are not affected by it
+		SDL_SetRenderDrawBlendMode(this->renderer, SDL_BLENDMODE_BLEND);
+		SDL_RenderGeometry(this->renderer, NULL, &this->vertices[0], this->vertices.size(), &this->indices[0], this->indices.size());
+		profiler.drawCalls++;
+	}
+	this->vertices.clear();
+	this->indices.clear();
+#endif
 }
 
 // -------------------------------------------------------------------------------------------------
 
+// Sprites and backgrounds are cut from two sheets, or from page 0 of the atlas --pack-atlas builds
+// out of them (see below) when compiled with -DATLAS
+class atlasSprite {
+	public:
+		int		 page;
+		SDL_Rect rect;
+};
+
+#ifdef ATLAS
+#include "atlas.h"
+
+#define SPRITES_FILE		atlasPages[0]
+#define BACKGROUNDS_FILE	atlasPages[0]
+#else
+#define SPRITES_FILE		"sprites.png"
+#define BACKGROUNDS_FILE	"background.png"
+
 const SDL_Rect PALM_TREE_SPRITE        	 	 = { .x =    5, .y =    5, .w =  215, .h =  540 };
 const SDL_Rect BILLBOARD08_SPRITE      		 = { .x =  230, .y =    5, .w =  385, .h =  265 };
 const SDL_Rect TREE1_SPRITE            		 = { .x =  625, .y =    5, .w =  360, .h =  360 };
@@ -164,6 +1114,55 @@ const SDL_Rect BACKGROUND_HILLS				 = { .x =    5, .y =    5, .w = 1280, .h =  4
 const SDL_Rect BACKGROUND_SKY				 = { .x =    5, .y =  495, .w = 1280, .h =  480 };
 const SDL_Rect BACKGROUND_TREES				 = { .x =    5, .y =  985, .w = 1280, .h =  480 };
 
+// Where the rects above come from, the first thing --pack-atlas packs
+class sheetSprite {
+	public:
+		const char 	   * name;
+		const SDL_Rect * rect;
+		const char	   * sheet;
+};
+
+const sheetSprite sheetSprites[] = {
+	{ "PALM_TREE_SPRITE",              &PALM_TREE_SPRITE,              SPRITES_FILE },
+	{ "BILLBOARD08_SPRITE",            &BILLBOARD08_SPRITE,            SPRITES_FILE },
+	{ "TREE1_SPRITE",                  &TREE1_SPRITE,                  SPRITES_FILE },
+	{ "DEAD_TREE1_SPRITE",             &DEAD_TREE1_SPRITE,             SPRITES_FILE },
+	{ "BILLBOARD09_SPRITE",            &BILLBOARD09_SPRITE,            SPRITES_FILE },
+	{ "BOULDER3_SPRITE",               &BOULDER3_SPRITE,               SPRITES_FILE },
+	{ "COLUMN_SPRITE",                 &COLUMN_SPRITE,                 SPRITES_FILE },
+	{ "BILLBOARD01_SPRITE",            &BILLBOARD01_SPRITE,            SPRITES_FILE },
+	{ "BILLBOARD06_SPRITE",            &BILLBOARD06_SPRITE,            SPRITES_FILE },
+	{ "BILLBOARD05_SPRITE",            &BILLBOARD05_SPRITE,            SPRITES_FILE },
+	{ "BILLBOARD07_SPRITE",            &BILLBOARD07_SPRITE,            SPRITES_FILE },
+	{ "BOULDER2_SPRITE",               &BOULDER2_SPRITE,               SPRITES_FILE },
+	{ "TREE2_SPRITE",                  &TREE2_SPRITE,                  SPRITES_FILE },
+	{ "BILLBOARD04_SPRITE",            &BILLBOARD04_SPRITE,            SPRITES_FILE },
+	{ "DEAD_TREE2_SPRITE",             &DEAD_TREE2_SPRITE,             SPRITES_FILE },
+	{ "BOULDER1_SPRITE",               &BOULDER1_SPRITE,               SPRITES_FILE },
+	{ "BUSH1_SPRITE",                  &BUSH1_SPRITE,                  SPRITES_FILE },
+	{ "CACTUS_SPRITE",                 &CACTUS_SPRITE,                 SPRITES_FILE },
+	{ "BUSH2_SPRITE",                  &BUSH2_SPRITE,                  SPRITES_FILE },
+	{ "BILLBOARD03_SPRITE",            &BILLBOARD03_SPRITE,            SPRITES_FILE },
+	{ "BILLBOARD02_SPRITE",            &BILLBOARD02_SPRITE,            SPRITES_FILE },
+	{ "STUMP_SPRITE",                  &STUMP_SPRITE,                  SPRITES_FILE },
+	{ "SEMI_SPRITE",                   &SEMI_SPRITE,                   SPRITES_FILE },
+	{ "TRUCK_SPRITE",                  &TRUCK_SPRITE,                  SPRITES_FILE },
+	{ "CAR03_SPRITE",                  &CAR03_SPRITE,                  SPRITES_FILE },
+	{ "CAR02_SPRITE",                  &CAR02_SPRITE,                  SPRITES_FILE },
+	{ "CAR04_SPRITE",                  &CAR04_SPRITE,                  SPRITES_FILE },
+	{ "CAR01_SPRITE",                  &CAR01_SPRITE,                  SPRITES_FILE },
+	{ "PLAYER_UPHILL_LEFT_SPRITE",     &PLAYER_UPHILL_LEFT_SPRITE,     SPRITES_FILE },
+	{ "PLAYER_UPHILL_STRAIGHT_SPRITE", &PLAYER_UPHILL_STRAIGHT_SPRITE, SPRITES_FILE },
+	{ "PLAYER_UPHILL_RIGHT_SPRITE",    &PLAYER_UPHILL_RIGHT_SPRITE,    SPRITES_FILE },
+	{ "PLAYER_LEFT_SPRITE",            &PLAYER_LEFT_SPRITE,            SPRITES_FILE },
+	{ "PLAYER_STRAIGHT_SPRITE",        &PLAYER_STRAIGHT_SPRITE,        SPRITES_FILE },
+	{ "PLAYER_RIGHT_SPRITE",           &PLAYER_RIGHT_SPRITE,           SPRITES_FILE },
+	{ "BACKGROUND_HILLS",              &BACKGROUND_HILLS,              BACKGROUNDS_FILE },
+	{ "BACKGROUND_SKY",                &BACKGROUND_SKY,                BACKGROUNDS_FILE },
+	{ "BACKGROUND_TREES",              &BACKGROUND_TREES,              BACKGROUNDS_FILE }
+};
+#endif
+
 class Sprite {
 	public:
 		SDL_Rect 	spriteRect;
@@ -176,7 +1175,6 @@ class Car {
 		float		x_offset;
 		int			z_offset; // Change segment because is moving....
 		int 		speed;
-		bool		moved;	
 };
 
 float scaleSprites = 0.3 * (1.0 / (float)PLAYER_STRAIGHT_SPRITE.w);
@@ -213,78 +1211,370 @@ int 	SCREEN_WIDTH    = 1024,
 		offRoadLimit   	=  maxSpeed / 4,		   // limit when off road deceleration no longer applies (e.g. you can always go at least this speed even when off road) 		
 		offRoadDecel    = -maxSpeed / 2,	   	   // off road deceleration is somewhere in between		
 		trackLength,
-		drawDistance 	= 300;                     // number of segments to draw
+		drawDistance 	= 300,                     // number of segments to draw
+		spriteDensity	= 1;					   // times the random roadside plants are scattered along the track
 
 float 	cameraDepth		= 1.0 / tan(((float)fieldOfView / 2.0) * __PI/180.0),
-		resolution 		= SCREEN_HEIGHT / 480.0,
 		playerX			= 0, 
 	  	playerZ			= (cameraHeight * cameraDepth),
 		centrifugal    	= 0.3,	
-		dt 				= 1.0 / FPS,			    // Period of time between frames = (1 / frames per second)
+		dt 				= 1.0 / FPS,			    // Period of time between simulation ticks = (1 / ticks per second)
+		maxFrameTime	= 0.25,						// longest time simulated per rendered frame, slower machines play in slow motion
     	skySpeed       	= 0.001,                    // background sky layer scroll speed when going around curve (or up hill)
     	hillSpeed      	= 0.002,                    // background hill layer scroll speed when going around curve (or up hill)
     	treeSpeed      	= 0.003;                    // background tree layer scroll speed when going around curve (or up hill)		
     	
-SDL_Rect playerSprite;
+
     	
 class Segment {
 	public:
 		int index;
 		int curve;
+		int palette;
 		SDL_Color colorRoad, colorGrass, colorRumble, colorLane;
 		float p1worldY , p1worldX  , p1worldZ ;
-		float p1cameraY, p1cameraX , p1cameraZ;
-		float p1screenY, p1screenX , p1screenW;
 		float p2worldY , p2worldX  , p2worldZ ;
-		float p2cameraY, p2cameraX , p2cameraZ;
-		float p2screenY, p2screenX , p2screenW;
-		bool  looped;
-		float fog;
-		int   clip;
-		std::vector<Sprite> sprites;
-		std::vector<Car> cars;		
 };
 	
 std::vector<Segment> segments;	
 
-Segment findSegment(int value) {
+Segment & findSegment(int value) {
 	return segments[(value/segmentLength) % segments.size()]; 
 }
-	
-void addSegment(int curve, float y) {
-	Segment segment;
+
+// Roadside sprites of every segment in CSR layout: the sprites of segment n go from sprites[first(n)]
+// to sprites[first(n + 1)]. They don't move once the track is built, so add() only stages them and
+// build() sorts them by segment in one go, keeping the order they were added in.
+class spriteStore {
+	public:
+		void clear(void);
+		void add(int segment, const Sprite & sprite);
+		void build(int numSegments);
+		void measure(void);
+		int  first(int segment) const;
+		int  size(void) const;
+		std::vector<Sprite> sprites;
+		std::vector<int>	offsets; // numSegments + 1 of them
+		int					largest; // longest side of any sprite, in sheet pixels
+	private:
+		std::vector<int>	stagedSegment;
+		std::vector<Sprite> staged;
+};
+
+void spriteStore::clear(void) {
+	this->largest = 0;
+	this->sprites.clear();
+	this->offsets.clear();
+	this->stagedSegment.clear();
+	this->staged.clear();
+}
+
+void spriteStore::add(int segment, const Sprite & sprite) {
+	this->stagedSegment.push_back(segment);
+	this->staged.push_back(sprite);
+}
+
+// Counting sort of the sprites already built followed by the staged ones
+void spriteStore::build(int numSegments) {
+	std::vector<int>	count(numSegments + 1, 0);
+	std::vector<Sprite> sorted;
 	// --
-	segment.p1worldX  = 0.0;
-	segment.p1cameraY = 0.0;
-	segment.p1cameraX = 0.0;
-	segment.p1cameraZ = 0.0;
-	segment.p1screenY = 0.0;
-	segment.p1screenX = 0.0;
-	segment.p1screenW = 0.0;
-	segment.p2worldX  = 0.0;
-	segment.p2cameraY = 0.0;
-	segment.p2cameraX = 0.0;
-	segment.p2cameraZ = 0.0;
-	segment.p2screenY = 0.0;
-	segment.p2screenX = 0.0;
-	segment.p2screenW = 0.0;	
-	// --
-	segment.index = segments.size();
-	segment.curve = curve;
-	if (segments.size() == 0)
-		segment.p1worldY = 0;
+	for (int n = 0; (n < numSegments) && (n + 1 < this->offsets.size()); n++)
+		count[n + 1] += this->offsets[n + 1] - this->offsets[n];
+	for (int i = 0; i < this->staged.size(); i++)
+		count[this->stagedSegment[i] + 1]++;
+	for (int n = 0; n < numSegments; n++)
+		count[n + 1] += count[n];
+	sorted.resize(count[numSegments]);
+	for (int n = 0; (n < numSegments) && (n + 1 < this->offsets.size()); n++)
+		for (int i = this->offsets[n]; i < this->offsets[n + 1]; i++)
+			sorted[count[n]++] = this->sprites[i];
+	for (int i = 0; i < this->staged.size(); i++)
+		sorted[count[this->stagedSegment[i]]++] = this->staged[i];
+	// count[n] now points at the end of segment n
+	this->offsets.resize(numSegments + 1);
+	this->offsets[0] = 0;
+	for (int n = 0; n < numSegments; n++)
+		this->offsets[n + 1] = count[n];
+	this->sprites.swap(sorted);
+	this->stagedSegment.clear();
+	this->staged.clear();
+	this->measure();
+}
+
+// largest again, for sprites filled in without build() (a loaded track)
+void spriteStore::measure(void) {
+	this->largest = 0;
+	for (int i = 0; i < this->sprites.size(); i++) {
+		const SDL_Rect & rect = this->sprites[i].spriteRect;
+		if (rect.w > this->largest) this->largest = rect.w;
+		if (rect.h > this->largest) this->largest = rect.h;
+	}
+}
+
+int spriteStore::first(int segment) const {
+	return (segment < this->offsets.size()) ? this->offsets[segment] : this->sprites.size();
+}
+
+int spriteStore::size(void) const {
+	return this->sprites.size();
+}
+
+spriteStore roadside;
+	
+// All the AI cars live in one contiguous array. Every segment keeps the cars on it as an intrusive
+// doubly linked list (head/tail per segment, next/prev per car), so moving a car to another segment
+// costs O(1), keeps the arrival order and allocates nothing once the cars are added.
+class trafficStore {
+	public:
+		void reset(int numSegments);
+		int  add(const Car & car);
+		void move(int car, int segment);
+		int  size(void);
+		int  first(int segment);
+		int  next(int car);
+		int  segmentOf(int car);
+		std::vector<Car>   cars;
+		std::vector<float> prevX;	// position at the previous tick, to interpolate between ticks
+		std::vector<int>   prevZ;
+	private:
+		std::vector<int> head, tail, nextCar, prevCar, carSegment;
+		void link(int car, int segment);
+		void unlink(int car);
+};
+
+void trafficStore::reset(int numSegments) {
+	this->cars.clear();
+	this->prevX.clear();
+	this->prevZ.clear();
+	this->nextCar.clear();
+	this->prevCar.clear();
+	this->carSegment.clear();
+	this->head.assign(numSegments, -1);
+	this->tail.assign(numSegments, -1);
+}
+
+int trafficStore::add(const Car & car) {
+	int n = this->cars.size();
+	this->cars.push_back(car);
+	this->prevX.push_back(car.x_offset);
+	this->prevZ.push_back(car.z_offset);
+	this->nextCar.push_back(-1);
+	this->prevCar.push_back(-1);
+	this->carSegment.push_back(-1);
+	this->link(n, (car.z_offset/segmentLength) % this->head.size());
+	return n;
+}
+
+void trafficStore::link(int car, int segment) {
+	this->carSegment[car] = segment;
+	this->nextCar[car] 	  = -1;
+	this->prevCar[car] 	  = this->tail[segment];
+	if (this->tail[segment] != -1)
+		this->nextCar[this->tail[segment]] = car;
 	else
-		segment.p1worldY = ((Segment)segments.back()).p2worldY;
-	segment.p1worldZ = segment.index * segmentLength;
-	segment.p2worldY = y;
-	segment.p2worldZ = (segment.index+1) * segmentLength;
-	if ( (segment.index == 2) || (segment.index == 3) ) {
+		this->head[segment] = car;
+	this->tail[segment] = car;
+}
+
+void trafficStore::unlink(int car) {
+	int segment = this->carSegment[car];
+	if (this->prevCar[car] != -1) this->nextCar[this->prevCar[car]] = this->nextCar[car]; else this->head[segment] = this->nextCar[car];
+	if (this->nextCar[car] != -1) this->prevCar[this->nextCar[car]] = this->prevCar[car]; else this->tail[segment] = this->prevCar[car];
+}
+
+void trafficStore::move(int car, int segment) {
+	if (this->carSegment[car] != segment) {
+		this->unlink(car);
+		this->link(car, segment);
+	}
+}
+
+int trafficStore::size(void) {
+	return this->cars.size();
+}
+
+// First car on a segment, -1 when there is none
+int trafficStore::first(int segment) {
+	return this->head[segment];
+}
+
+// Next car on the same segment, -1 at the end
+int trafficStore::next(int car) {
+	return this->nextCar[car];
+}
+
+int trafficStore::segmentOf(int car) {
+	return this->carSegment[car];
+}
+
+trafficStore traffic;
+
+// Per frame projection of the drawn segments, kept apart from the read only track data in Segment.
+// Slot i holds segment (baseIndex + i) and every field is a contiguous array, so the screen
+// projection is a straight pass over floats the compiler can vectorize.
+class roadProjection {
+	public:
+		roadProjection();
+		void  project(int position, int baseIndex, float basePercent, float playerX, float playerY, int count, int width, int height);
+		int   size, position, baseIndex;
+		std::vector<float>	p1cameraY, p1cameraX , p1cameraZ,
+							p1screenY, p1screenX , p1screenW,
+							p2cameraY, p2cameraX , p2cameraZ,
+							p2screenY, p2screenX , p2screenW;
+		std::vector<int>	clip;
+	private:
+		void resize(int size);
+};
+
+roadProjection::roadProjection() {
+	this->size		= 0;
+	this->position	= 0;
+	this->baseIndex	= 0;
+}
+
+void roadProjection::resize(int size) {
+	this->size = size;
+	this->p1cameraY.resize(size);	this->p1cameraX.resize(size);	this->p1cameraZ.resize(size);
+	this->p1screenY.resize(size);	this->p1screenX.resize(size);	this->p1screenW.resize(size);
+	this->p2cameraY.resize(size);	this->p2cameraX.resize(size);	this->p2cameraZ.resize(size);
+	this->p2screenY.resize(size);	this->p2screenX.resize(size);	this->p2screenW.resize(size);
+	this->clip.resize(size);
+}
+
+// Prefix sums of the segment curves over two laps: sum1[n] adds up the first n curves and sum2[n]
+// the first n of those. The lateral offset of any slot of the draw window comes straight out of
+// them, with no dependency on the slots in front. World y needs nothing, it is absolute already.
+// Rebuilt in one pass whenever the road changes, from the first segment that changed onwards.
+class curveTable {
+	public:
+		void build(int from = 0);
+		std::vector<long long> sum1, sum2;
+};
+
+void curveTable::build(int from) {
+	int size = segments.size();
+	// --
+	if (this->sum1.size() != 2 * size + 1) {
+		from = 0;
+		this->sum1.resize(2 * size + 1);
+		this->sum2.resize(2 * size + 1);
+	}
+	this->sum1[0] = 0;
+	this->sum2[0] = 0;
+	for (int n = from; n < 2 * size; n++) {
+		this->sum1[n + 1] = this->sum1[n] + segments[n % size].curve;
+		this->sum2[n + 1] = this->sum2[n] + this->sum1[n];
+	}
+}
+
+curveTable roadCurves;
+
+void roadProjection::project(int position, int baseIndex, float basePercent, float playerX, float playerY, int count, int width, int height) {
+	int		road	= roadWidth,
+			offsetZ;
+	float	dx0		= - (segments[baseIndex].curve * basePercent),
+			x, dx,
+			cameraX	= playerX * roadWidth,
+			cameraY = playerY + cameraHeight,
+			halfW	= width/2,
+			halfH	= height/2,
+			depth	= cameraDepth,
+			scale1, scale2;
+	// --
+	if (this->size != count) this->resize(count);
+	this->position	= position;
+	this->baseIndex	= baseIndex;
+	if (roadCurves.sum1.size() != 2 * segments.size() + 1) roadCurves.build();
+	// Camera space. Slot i is dx0 + (curves from the base to slot i) off the direction of slot 0 and
+	// the lateral offset adds up those directions, both read from the prefix sums
+	const long long * __restrict__ sum1 = &roadCurves.sum1[baseIndex],
+					* __restrict__ sum2 = &roadCurves.sum2[baseIndex];
+	for (int i = 0; i < count; i++) {
+		const Segment & segment = segments[(baseIndex + i) % segments.size()];
+		offsetZ = position - ((baseIndex + i >= segments.size()) ? trackLength : 0); // looped
+		x  = i * dx0 + (float)(sum2[i] - sum2[0] - i * sum1[0]);
+		dx = dx0 + (float)(sum1[i] - sum1[0]);
+		this->p1cameraX[i] = segment.p1worldX - (cameraX - x);
+		this->p1cameraY[i] = segment.p1worldY - cameraY;
+		this->p1cameraZ[i] = segment.p1worldZ - offsetZ;
+		this->p2cameraX[i] = segment.p2worldX - (cameraX - x - dx);
+		this->p2cameraY[i] = segment.p2worldY - cameraY;
+		this->p2cameraZ[i] = segment.p2worldZ - offsetZ;
+	}
+	// Screen space, no dependency between slots
+	float 	* __restrict__ p1cameraX = &this->p1cameraX[0], * __restrict__ p1cameraY = &this->p1cameraY[0], * __restrict__ p1cameraZ = &this->p1cameraZ[0],
+			* __restrict__ p2cameraX = &this->p2cameraX[0], * __restrict__ p2cameraY = &this->p2cameraY[0], * __restrict__ p2cameraZ = &this->p2cameraZ[0],
+			* __restrict__ p1screenX = &this->p1screenX[0], * __restrict__ p1screenY = &this->p1screenY[0], * __restrict__ p1screenW = &this->p1screenW[0],
+			* __restrict__ p2screenX = &this->p2screenX[0], * __restrict__ p2screenY = &this->p2screenY[0], * __restrict__ p2screenW = &this->p2screenW[0];
+	for (int i = 0; i < count; i++) {
+		scale1 = depth/p1cameraZ[i];
+		scale2 = depth/p2cameraZ[i];
+		p1screenX[i] = roundf(halfW + (scale1 * p1cameraX[i] * width/2));
+		p1screenY[i] = roundf(halfH - (scale1 * p1cameraY[i] * height/2));
+		p1screenW[i] = roundf(scale1 * road * width/2);
+		p2screenX[i] = roundf(halfW + (scale2 * p2cameraX[i] * width/2));
+		p2screenY[i] = roundf(halfH - (scale2 * p2cameraY[i] * height/2));
+		p2screenW[i] = roundf(scale2 * road * width/2);
+	}
+}
+
+// Exponential fog of every drawn slot, tabulated again only when drawDistance or fogDensity change.
+// Fog is folded into the road colors of each segment instead of blended over them afterwards.
+class fogTable {
+	public:
+		fogTable();
+		void 	  update(int count, int density);
+		SDL_Color apply(const SDL_Color color, int slot) const;
+		std::vector<float> factor;
+	private:
+		int count, density;
+		std::vector<int> alpha;
+};
+
+fogTable::fogTable() {
+	this->count	  = -1;
+	this->density = -1;
+}
+
+void fogTable::update(int count, int density) {
+	if ((count == this->count) && (density == this->density))
+		return;
+	this->count	  = count;
+	this->density = density;
+	this->factor.resize(count);
+	this->alpha.resize(count);
+	for (int i = 0; i < count; i++) {
+		this->factor[i] = 1.0/pow((float)__E, (float)(i)/(float)(count) * (float)(i)/(float)(count) * (float)density);
+		this->alpha[i]	= 255 - (Uint8)(this->factor[i]*255); // same alpha the fog overlay was blended with
+	}
+}
+
+SDL_Color fogTable::apply(const SDL_Color color, int slot) const {
+	SDL_Color fogged = color;
+	int a = this->alpha[slot];
+	// --
+	if (a != 0) {
+		fogged.r = (FOG_COLOR.r * a + color.r * (255 - a) + 127) / 255;
+		fogged.g = (FOG_COLOR.g * a + color.g * (255 - a) + 127) / 255;
+		fogged.b = (FOG_COLOR.b * a + color.b * (255 - a) + 127) / 255;
+	}
+	return fogged;
+}
+
+fogTable roadFog;
+
+enum { PALETTE_DARK, PALETTE_LIGHT, PALETTE_START, NUM_PALETTES };
+
+void setPalette(Segment & segment, int palette) {
+	segment.palette = palette;
+	if (palette == PALETTE_START) {
 		segment.colorRoad	= WHITE_COLOR;
 		segment.colorGrass	= WHITE_COLOR;
 		segment.colorRumble	= WHITE_COLOR;
 		segment.colorLane	= WHITE_COLOR;
 	} else 
-		if ((segment.index / rumbleLength)%2 == true) {
+		if (palette == PALETTE_LIGHT) {
 			segment.colorRoad	= LIGHT_ROAD_COLOR;
 			segment.colorGrass	= LIGHT_GRASS_COLOR;
 			segment.colorRumble	= LIGHT_RUMBLE_COLOR;
@@ -295,6 +1585,27 @@ void addSegment(int curve, float y) {
 			segment.colorRumble = DARK_RUMBLE_COLOR;
 			segment.colorLane	= DARK_LANE_COLOR;
 		}
+}
+
+void addSegment(int curve, float y) {
+	Segment segment;
+	// --
+	segment.p1worldX  = 0.0;
+	segment.p2worldX  = 0.0;
+	// --
+	segment.index = segments.size();
+	segment.curve = curve;
+	if (segments.size() == 0)
+		segment.p1worldY = 0;
+	else
+		segment.p1worldY = segments.back().p2worldY;
+	segment.p1worldZ = segment.index * segmentLength;
+	segment.p2worldY = y;
+	segment.p2worldZ = (segment.index+1) * segmentLength;
+	if ( (segment.index == 2) || (segment.index == 3) )
+		setPalette(segment, PALETTE_START);
+	else 
+		setPalette(segment, ((segment.index / rumbleLength)%2 == true) ? PALETTE_LIGHT : PALETTE_DARK);
 	segments.push_back(segment); 
 }	
 	
@@ -303,18 +1614,27 @@ void addRoad(int numSegmentsEnter, int numSegmentsHold, int numSegmentsLeave, in
 	if (segments.size() == 0)
 		startY = 0;
 	else 	
-		startY = ((Segment)segments.back()).p2worldY;
+		startY = segments.back().p2worldY;
 	float endY     = startY + (float)(y) * (float)(segmentLength);
+	int   total	   = numSegmentsEnter + numSegmentsHold + numSegmentsLeave;
+	// The height easing steps through the whole piece by rotation instead of a cos() per segment.
+	// The curve easing of the leave part keeps its cos(), its halfway point has to round as it did.
+	double 	stepCos  = cos(__PI / total), stepSin  = sin(__PI / total),
+			c = 1, s = 0, t;
 	// --
-	for (int i = 0; i < numSegmentsEnter; i++)
-		addSegment (curve * (i / numSegmentsEnter) * (i / numSegmentsEnter), 
-					startY + (endY - startY) * ((-cos(((float)i / (float)(numSegmentsEnter+numSegmentsHold+numSegmentsLeave))*__PI) / 2.0) + 0.5));
-	for (int i = 0; i < numSegmentsHold; i++)
-		addSegment (curve,
-					startY + (endY - startY) * ((-cos(((float)(numSegmentsEnter + i) / (float)(numSegmentsEnter+numSegmentsHold+numSegmentsLeave))*__PI) / 2.0) + 0.5));
-	for (int i = 0; i < numSegmentsLeave; i++)
-		addSegment (curve + (-curve) * ((-cos(((float)i / (float)numSegmentsLeave)*__PI) / 2.0) + 0.5),
-					startY + (endY - startY) * ((-cos(((float)(numSegmentsEnter + numSegmentsHold + i) / (float)(numSegmentsEnter+numSegmentsHold+numSegmentsLeave))*__PI) / 2.0) + 0.5));
+	for (int i = 0; i < total; i++) {
+		if (i < numSegmentsEnter)
+			addSegment (curve * (i / numSegmentsEnter) * (i / numSegmentsEnter), startY + (endY - startY) * ((-c / 2.0) + 0.5));
+		else if (i < numSegmentsEnter + numSegmentsHold)
+			addSegment (curve, startY + (endY - startY) * ((-c / 2.0) + 0.5));
+		else {
+			addSegment (curve + (-curve) * ((-cos(((float)(i - numSegmentsEnter - numSegmentsHold) / (float)numSegmentsLeave)*__PI) / 2.0) + 0.5),
+						startY + (endY - startY) * ((-c / 2.0) + 0.5));
+		}
+		t = c * stepCos - s * stepSin;
+		s = s * stepCos + c * stepSin;
+		c = t;
+	}
 }
 
 void addStraight(int length) {
@@ -358,7 +1678,7 @@ void addBumps(void) {
 }
 
 void addDownhillToEnd(int length) {
-    addRoad(length, length, length, -CURVE_EASY, -(((Segment)segments.back()).p2worldY)/segmentLength);
+    addRoad(length, length, length, -CURVE_EASY, -(segments.back().p2worldY)/segmentLength);
 }
     
 // --------------------------------------------------------------------------------------
@@ -384,10 +1704,53 @@ void resetRoad(void) {
 	addDownhillToEnd(200);
 	
 	trackLength = segments.size() * segmentLength;	
+	roadCurves.build();
+}
+
+// Explicitly seeded generators, one per subsystem, in place of rand(): the same seed builds the same
+// world with any C library, and drawing (the player's bounce) never shifts the simulation. The
+// old randomize() and random(min, max) macros live on as methods (random(1, -1) still gives 1).
+class randomStream {
+	public:
+		randomStream();
+		void   seed(Uint32 seed);
+		int    next(void);					// 0..32767
+		double randomize(void);				// 0..1, both included
+		int	   random(int min, int max);
+	private:
+		Uint32 state;
+};
+
+randomStream::randomStream() {
+	this->state = 1;
+}
+
+void randomStream::seed(Uint32 seed) {
+	this->state = seed;
+}
+
+int randomStream::next(void) {
+	this->state = this->state * 1103515245 + 12345;
+	return (this->state >> 16) & 0x7FFF;
+}
+
+double randomStream::randomize(void) {
+	return (double)this->next() / 32767.0;
+}
+
+int randomStream::random(int min, int max) {
+	return (this->next() % (max - min + 1)) + min;
 }
 
-#define randomize()			((double) rand() / (double)(RAND_MAX))
-#define random(min, max)	({ __typeof__ (min) _min = (min); __typeof__ (max) _max = (max); (rand()%(_max - _min + 1)) + _min; })
+randomStream trackRandom,		// roadside sprites
+			 trafficRandom,		// cars
+			 effectsRandom;		// drawing only
+
+void seedRandom(Uint32 seed) {
+	trackRandom.seed(seed);
+	trafficRandom.seed(seed ^ 0x5BD1E995);
+	effectsRandom.seed(seed ^ 0x1B873593);
+}
 
 SDL_Texture * loadSpriteSheet(SDL_Renderer* renderer, const char * filename) {
     SDL_Surface * spriteSheet = IMG_Load(filename);
@@ -401,7 +1764,7 @@ void addSprite(int numSegment, SDL_Rect spriteRect, float x_offset) {
 	sprite.spriteRect	= spriteRect;
 	sprite.x_offset   	= x_offset;
 	if ((numSegment >= 0) && (numSegment < segments.size()))
-		segments[numSegment].sprites.push_back(sprite);
+		roadside.add(numSegment, sprite);
 }
 
 void resetSprites(void) {
@@ -420,333 +1783,2491 @@ void resetSprites(void) {
 	addSprite(segments.size() - 25, BILLBOARD06_SPRITE,  1.2);
 
 	for (int numSegment = 10; numSegment < 200 ; numSegment += 4 + (float)numSegment/100.0) {
-		addSprite(numSegment, PALM_TREE_SPRITE, 0.5 + randomize()*0.5);
-	    addSprite(numSegment, PALM_TREE_SPRITE,   1 + randomize()*2);
+		addSprite(numSegment, PALM_TREE_SPRITE, 0.5 + trackRandom.randomize()*0.5);
+	    addSprite(numSegment, PALM_TREE_SPRITE,   1 + trackRandom.randomize()*2);
 	}
 	
+	// Draws that go in the same call are taken one by one first, so the order does not depend on the compiler
+	int offset, plant;
 	for (int numSegment = 250; numSegment < 1000; numSegment += 5) {
 	    addSprite(numSegment							, COLUMN_SPRITE, 1.1);
-	    addSprite(numSegment + random(0,5), TREE1_SPRITE, -1 - (randomize() * 2));
-	    addSprite(numSegment + random(0,5), TREE2_SPRITE, -1 - (randomize() * 2));
+	    offset = trackRandom.random(0,5);
+	    addSprite(numSegment + offset, TREE1_SPRITE, -1 - (trackRandom.randomize() * 2));
+	    offset = trackRandom.random(0,5);
+	    addSprite(numSegment + offset, TREE2_SPRITE, -1 - (trackRandom.randomize() * 2));
 	}
 	
 	SDL_Rect plants[12] 	= { TREE1_SPRITE, TREE2_SPRITE, DEAD_TREE1_SPRITE, DEAD_TREE2_SPRITE, PALM_TREE_SPRITE, BUSH1_SPRITE, BUSH2_SPRITE, CACTUS_SPRITE, STUMP_SPRITE, BOULDER1_SPRITE, BOULDER2_SPRITE, BOULDER3_SPRITE}; 
 	SDL_Rect billboards[9]  = { BILLBOARD01_SPRITE, BILLBOARD02_SPRITE, BILLBOARD03_SPRITE, BILLBOARD04_SPRITE, BILLBOARD05_SPRITE, BILLBOARD06_SPRITE, BILLBOARD07_SPRITE, BILLBOARD08_SPRITE, BILLBOARD09_SPRITE};
+	int side;
 	
 	for (int numSegment = 200; numSegment < segments.size(); numSegment += 3)
-	    addSprite(numSegment, plants[random(0, 11)], random(1,-1) * (2 + randomize() * 5));
+		for (int n = 0; n < spriteDensity; n++) {
+			plant = trackRandom.random(0, 11);
+			side  = trackRandom.random(1,-1);
+	    	addSprite(numSegment, plants[plant], side * (2 + trackRandom.randomize() * 5));
+		}
 
-	int side;
 	for (int numSegment = 1000; numSegment < (segments.size()-50); numSegment += 100) {
-	    side = random(1, -1); // Left or Right
-		addSprite(numSegment + random(0, 50), billboards[random(0,8)], side);
-	    for (int i = 0; i < 20; i++) 
-	      	addSprite(numSegment + random(0, 50), plants[random(0, 11)], side * (1.5 + randomize()));
+	    side   = trackRandom.random(1, -1); // Left or Right
+	    offset = trackRandom.random(0, 50);
+		addSprite(numSegment + offset, billboards[trackRandom.random(0,8)], side);
+	    for (int i = 0; i < 20; i++) {
+	    	offset = trackRandom.random(0, 50);
+	    	plant  = trackRandom.random(0, 11);
+	      	addSprite(numSegment + offset, plants[plant], side * (1.5 + trackRandom.randomize()));
+		}
+	}
+	roadside.build(segments.size());
+}
+
+// Collision spans of the roadside sprites in CSR layout: the spans of segment n are
+// [spanMin, spanMax] from first[n] to first[n+1]. Sprites never move, so they are built once
+// (the endless road rebuilds them from the first slot it refilled).
+class spriteSpans {
+	public:
+		void build(int from = 0);
+		bool hit(int segment, float x, float w);
+	private:
+		std::vector<int>	first;
+		std::vector<float>	spanMin, spanMax;
+};
+
+void spriteSpans::build(int from) {
+	float x, w, half = 1.0 / 2.0;
+	// --
+	if (from >= this->first.size()) from = 0;
+	this->first.resize(from + 1, 0);
+	this->spanMin.resize(this->first[from]);
+	this->spanMax.resize(this->first[from]);
+	for (int n = from; n < segments.size(); n++) {
+		for (int i = roadside.first(n); i < roadside.first(n + 1); i++) {
+			const Sprite & sprite = roadside.sprites[i];
+			w = sprite.spriteRect.w * scaleSprites;
+			x = sprite.x_offset + w/2 * (sprite.x_offset > 0 ? 1 : -1);
+			this->spanMin.push_back(x - (w * half));
+			this->spanMax.push_back(x + (w * half));
+		}
+		this->first.push_back(this->spanMin.size());
 	}
 }
 
-void resetCars(void) {
+// Same test as collision() with a 1.0 percent against every sprite of the segment
+bool spriteSpans::hit(int segment, float x, float w) {
+	float 	half = 1.0 / 2.0,
+			min1 = x - (w * half),
+			max1 = x + (w * half);
+	for (int i = this->first[segment]; i < this->first[segment + 1]; i++)
+		if (!((max1 < this->spanMin[i]) || (min1 > this->spanMax[i])))
+			return true;
+	return false;
+}
+
+spriteSpans spriteCollision;
+
+void resetCars(int numCars) {
 	SDL_Rect cars [6] = {CAR01_SPRITE, CAR02_SPRITE, CAR03_SPRITE, CAR04_SPRITE, SEMI_SPRITE, TRUCK_SPRITE};
 	//Segment segment;
 	Car car;
 	int carType;
-	for (int i = 0; i < totalCars; i++) {	
-		carType 		= random(0, 5);
-		car.x_offset	= randomize() * ((float) (random(0,18) - 9) / 10.0);
-		car.z_offset	= randomize() * segments.size() * segmentLength;
-		car.speed	 	= maxSpeed / 4.0 + (randomize() * maxSpeed / (carType == 4 ? 4.0 : 2.0));	
+	float lane;
+	traffic.reset(segments.size());
+	for (int i = 0; i < numCars; i++) {	
+		carType 		= trafficRandom.random(0, 5);
+		lane			= trafficRandom.randomize();
+		car.x_offset	= lane * ((float) (trafficRandom.random(0,18) - 9) / 10.0);
+		car.z_offset	= trafficRandom.randomize() * segments.size() * segmentLength;
+		car.speed	 	= maxSpeed / 4.0 + (trafficRandom.randomize() * maxSpeed / (carType == 4 ? 4.0 : 2.0));	
 		car.spriteRect	= cars[carType];
-		car.moved 		= false; 
-		segments[(car.z_offset/segmentLength) % segments.size()].cars.push_back(car);
-/*		segment = findSegment(car.z_offset);
-		segment.cars.push_back(car);
-		segments[segment.index]	= segment;*/
+		traffic.add(car);
 	}
 }
 
-// --------------------------------------------------------------------------------------
+// -- Track files -----------------------------------------------------------------------
+// A compiled track replaces resetRoad and resetSprites: a header, one record per segment and the
+// roadside sprites of all segments one after the other, segment n owning the sprites from its
+// firstSprite to the next segment's. Host byte order, read in place from a memory mapped file, so a track
+// only loads on machines of the byte order it was compiled on.
+// Segment n starts where segment n-1 ends (p1worldY), z comes from the index and segmentLength.
+#define TRACK_MAGIC		0x545A5243			// "CRZT"
+#define TRACK_VERSION	1
 
-#define max(a,b) ({ __typeof__ (a) _a = (a); __typeof__ (b) _b = (b); _a > _b ? _a : _b; })
-#define min(a,b) ({ __typeof__ (a) _a = (a); __typeof__ (b) _b = (b); _a < _b ? _a : _b; })
+class trackHeader {
+	public:
+		Uint32	magic, version, numSegments, numSprites, segmentLength, trafficSeed; // 0 = random traffic every run
+};
 
-void renderSprite(SDL_Renderer* renderer, int width, int height, float resolution, int roadWidth, SDL_Texture * spriteSheet, SDL_Rect spriteRect, float spriteScale, float X, float Y, float offsetX, float offsetY, int clipY, bool flip) {
-	SDL_Rect dstrect;
-	dstrect.w	= (spriteRect.w * spriteScale * width / 2.0) * (scaleSprites * roadWidth);
-	dstrect.h	= (spriteRect.h * spriteScale * width / 2.0) * (scaleSprites * roadWidth);
-	dstrect.x	= X + dstrect.w * offsetX;
-	dstrect.y 	= Y + dstrect.h * offsetY;	 
-    float clipH = (clipY != 0) ? max(0, dstrect.y + dstrect.h - clipY) : 0;
+class trackSegment {
+	public:
+		Sint32	curve;
+		float	y;
+		Uint32	firstSprite;
+		Uint32	palette;
+};
+
+class trackSprite {
+	public:
+		Uint16	x, y, w, h;
+		float	x_offset;
+};
+
+// Writes the road and roadside sprites currently built, as they are
+bool saveTrack(const char * filename, Uint32 trafficSeed) {
+	trackHeader	 header;
+	trackSegment record;
+	trackSprite	 sprite;
 	// --
-	if (clipH < dstrect.h) {
-		spriteRect.h -= (spriteRect.h * clipH / dstrect.h);
-		dstrect.h -= clipH;
-		if (flip == true)
-			SDL_RenderCopyEx(renderer, spriteSheet, &spriteRect, &dstrect, NULL, NULL, SDL_FLIP_HORIZONTAL);
-		else
-			SDL_RenderCopy(renderer, spriteSheet, &spriteRect, &dstrect);
+	std::ofstream file(filename, std::ios::out | std::ios::binary);
+	if (!file)
+		return false;
+	header.magic		 = TRACK_MAGIC;
+	header.version		 = TRACK_VERSION;
+	header.numSegments	 = segments.size();
+	header.numSprites	 = roadside.first(segments.size());
+	header.segmentLength = segmentLength;
+	header.trafficSeed	 = trafficSeed;
+	file.write((const char *)&header, sizeof(header));
+	for (int i = 0; i < segments.size(); i++) {
+		record.curve		= segments[i].curve;
+		record.y			= segments[i].p2worldY;
+		record.firstSprite	= roadside.first(i);
+		record.palette		= segments[i].palette;
+		file.write((const char *)&record, sizeof(record));
 	}
+	for (int j = 0; j < header.numSprites; j++) {
+		sprite.x		= roadside.sprites[j].spriteRect.x;
+		sprite.y		= roadside.sprites[j].spriteRect.y;
+		sprite.w		= roadside.sprites[j].spriteRect.w;
+		sprite.h		= roadside.sprites[j].spriteRect.h;
+		sprite.x_offset	= roadside.sprites[j].x_offset;
+		file.write((const char *)&sprite, sizeof(sprite));
+	}
+	return file.good();
 }
 
-void renderPlayer(SDL_Renderer* renderer, int width, int height, float resolution, int roadWidth, SDL_Texture * spriteSheet, float speedPercent, float spriteScale, float X, float Y, float steer, float updown, bool offroad) {
-	SDL_Rect spriteRect;	
-	float bounce = (1.5 * randomize() * speedPercent * resolution) * ( (random(0, 20) - 10) / 10.0);
-	
-	if (offroad) bounce *= 5;
-	
-	if (steer < 0)
-     	spriteRect = (updown > 0) ? PLAYER_UPHILL_LEFT_SPRITE : PLAYER_LEFT_SPRITE;
-    else if (steer > 0)
-      	spriteRect = (updown > 0) ? PLAYER_UPHILL_RIGHT_SPRITE : PLAYER_RIGHT_SPRITE;
-    else
-      	spriteRect = (updown > 0) ? PLAYER_UPHILL_STRAIGHT_SPRITE : PLAYER_STRAIGHT_SPRITE;
-
-	playerSprite = spriteRect;
-    renderSprite(	renderer, 
-					width, 
-					height, 
-					resolution, 
-					roadWidth, 
-					spriteSheet, 
-					spriteRect,
-					spriteScale,
-					X, 
-					Y + bounce, 
-					-0.5, 
-					-1.0,
-					0,
-					false
-				);	
+// Maps a whole file read only, size set to 0 when it fails. unmapFile releases it.
+const char * mapFile(const char * filename, size_t * size) {
+	const char * data = NULL;
+	*size = 0;
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping != NULL) {
+		data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (data != NULL) *size = GetFileSize(file, NULL);
+		CloseHandle(mapping);
+	}
+	CloseHandle(file);
+#else
+	struct stat info;
+	int file = open(filename, O_RDONLY);
+	if (file < 0)
+		return NULL;
+	if ((fstat(file, &info) == 0) && (info.st_size > 0)) {
+		data = (const char *)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (data == MAP_FAILED) data = NULL; else *size = info.st_size;
+	}
+	close(file);
+#endif
+	return data;
 }
- 
-void renderBackground(SDL_Renderer* renderer, SDL_Texture * backgrounds, int width, int height, SDL_Rect spriteRect, float rotation, float y_offset)  {
-    SDL_Rect srcrect;
-    srcrect.x = spriteRect.x + (spriteRect.w * rotation);
-    srcrect.y = spriteRect.y;
-    srcrect.w = spriteRect.w + spriteRect.x - srcrect.x;//min(spriteRect.w / 2, spriteRect.w - (spriteRect.w * rotation));
-    srcrect.h = spriteRect.h;
-    
-    SDL_Rect dstrect;
-	dstrect.x = 0;
-    dstrect.y = y_offset;
-    dstrect.w = srcrect.w * ((float)width/(float)spriteRect.w) + 1;//width * (srcrect.w / (spriteRect.w / 2));
-    dstrect.h = height;
 
-	SDL_RenderCopy(renderer, backgrounds, &srcrect, &dstrect);
+void unmapFile(const char * data, size_t size) {
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap((void *)data, size);
+#endif
+}
 
- 	srcrect.x = spriteRect.x;
-   	srcrect.w = spriteRect.w;//(spriteRect.w / 2) - srcrect.w;
-   	dstrect.x = dstrect.w - 1;
-   	dstrect.w = spriteRect.w * ((float)width/(float)spriteRect.w) + 1;//width - (width * (srcrect.w / (spriteRect.w / 2)));
+// Replaces the road and roadside sprites with a compiled track. Seeds trafficRandom for resetCars when the
+// track has a traffic seed. Segments and sprites are allocated once each.
+bool loadTrack(const char * filename) {
+	size_t 				 size;
+	const char		   * data = mapFile(filename, &size);
+	const trackHeader  * header;
+	const trackSegment * records;
+	const trackSprite  * sprites;
+	// --
+	if (data == NULL) {
+		std::cout << "Track " << filename << " could not be opened" << std::endl;
+		return false;
+	}
+	header	= (size < sizeof(trackHeader)) ? NULL : (const trackHeader *)data;
+	// The counts are bounded by the file size before they are multiplied, and the track length must fit an int
+	if ((header == NULL) || (header->magic != TRACK_MAGIC) || (header->version != TRACK_VERSION) || (header->numSegments == 0) || (header->segmentLength == 0) ||
+		(header->numSegments > (size - sizeof(trackHeader)) / sizeof(trackSegment)) ||
+		(header->numSprites > (size - sizeof(trackHeader) - (size_t)header->numSegments * sizeof(trackSegment)) / sizeof(trackSprite)) ||
+		(header->segmentLength > INT_MAX / header->numSegments) ||
+		(size != sizeof(trackHeader) + (size_t)header->numSegments * sizeof(trackSegment) + (size_t)header->numSprites * sizeof(trackSprite))) {
+		std::cout << "Track " << filename << " is not a version " << TRACK_VERSION << " track" << std::endl;
+		unmapFile(data, size);
+		return false;
+	}
+	records	= (const trackSegment *)(header + 1);
+	sprites	= (const trackSprite *)(records + header->numSegments);
+	for (int i = 0; i < header->numSegments; i++)
+		if ((records[i].firstSprite > ((i + 1 < header->numSegments) ? records[i + 1].firstSprite : header->numSprites)) || ((i == 0) && (records[i].firstSprite != 0))) {
+			std::cout << "Track " << filename << " has its sprites out of order" << std::endl;
+			unmapFile(data, size);
+			return false;
+		}
+	segmentLength = header->segmentLength;
+	segments.clear();
+	segments.resize(header->numSegments);
+	roadside.clear();
+	roadside.offsets.resize(header->numSegments + 1);
+	roadside.offsets[header->numSegments] = header->numSprites;
+	roadside.sprites.resize(header->numSprites);
+	for (int j = 0; j < header->numSprites; j++) {
+		roadside.sprites[j].spriteRect.x = sprites[j].x;
+		roadside.sprites[j].spriteRect.y = sprites[j].y;
+		roadside.sprites[j].spriteRect.w = sprites[j].w;
+		roadside.sprites[j].spriteRect.h = sprites[j].h;
+		roadside.sprites[j].x_offset	 = sprites[j].x_offset;
+	}
+	for (int i = 0; i < header->numSegments; i++) {
+		Segment & segment = segments[i];
+		segment.index	 = i;
+		segment.curve	 = records[i].curve;
+		segment.p1worldX = 0.0;
+		segment.p2worldX = 0.0;
+		segment.p1worldY = (i == 0) ? 0 : records[i - 1].y;
+		segment.p2worldY = records[i].y;
+		segment.p1worldZ = i * segmentLength;
+		segment.p2worldZ = (i + 1) * segmentLength;
+		setPalette(segment, (records[i].palette < NUM_PALETTES) ? records[i].palette : PALETTE_DARK);
+		roadside.offsets[i] = records[i].firstSprite;
+	}
+	roadside.measure();
+	trackLength = segments.size() * segmentLength;
+	roadCurves.build();
+	if (header->trafficSeed != 0)
+		trafficRandom.seed(header->trafficSeed);
+	unmapFile(data, size);
+	return true;
+}
 
-	SDL_RenderCopy(renderer, backgrounds, &srcrect, &dstrect);
+// Offline track compiler: runs the resetRoad builder calls (repeated until the track has at least
+// minSegments) and resetSprites with the given seed, and saves the result with it as traffic seed.
+int compileTrack(const char * filename, int seed, int minSegments) {
+	seedRandom(seed);
+	do resetRoad(); while (segments.size() < minSegments);
+	resetSprites();
+	if (saveTrack(filename, seed) == false) {
+		std::cout << "Track " << filename << " could not be written" << std::endl;
+		return 1;
+	}
+	std::cout << filename << ": " << segments.size() << " segments" << std::endl;
+	return 0;
 }
 
-void renderSegment(SDL_Renderer* renderer, int width, int numLanes, Segment segment) {
-	float 	x1 = segment.p1screenX,
-			y1 = segment.p1screenY,
-			w1 = segment.p1screenW,
-			x2 = segment.p2screenX,
-			y2 = segment.p2screenY,
-			w2 = segment.p2screenW;	
-	
-	float 	r1 = w1 / max(6 , 2 * numLanes),
-			r2 = w2 / max(6 , 2 * numLanes),
-			l1 = w1 / max(32, 8 * numLanes),
-			l2 = w2 / max(32, 8 * numLanes);
+// -- Endless road ----------------------------------------------------------------------
+// segments becomes a ring of a fixed number of slots holding the road from a little behind the
+// player to past the traffic look-ahead. Every slot left behind is given the next segment of an
+// endless road, generated piece by piece from the addRoad primitives with a seeded generator.
+// The ring is a lap as far as the rest of the game knows, so memory and frame time stay the same
+// however far you drive. Absolute segment numbers only decide rumble banding and roadside sprites.
+class endlessTrack {
+	public:
+		endlessTrack();
+		void start(Uint32 seed);
+		void advance(int position);
+		bool enabled;
+		int	 cars;			 // traffic on the ring, in place of totalCars
+		long long generated; // segments handed to the ring so far
+	private:
+		std::vector<Segment> pending;
+		std::vector<Sprite>	 slotSprites; // up to stride sprites per ring slot, copied to roadside when it changes
+		std::vector<int>	 slotCount;
+		int		  stride;
+		int		  next; // pending segment to place next
+		float	  lastY;
+		Uint32	  state;
+		int		  pick(int min, int max);
+		void	  generate(void);
+		void	  place(void);
+		void	  storeSprites(int from);
+};
 
-	int points[4][2];
-	
-	points[0][0] = 0;  			points[0][1] = y2;
-	points[1][0] = width-1; 	points[1][1] = y2;
-	points[2][0] = width-1;		points[2][1] = y1;
-	points[3][0] = 0;  			points[3][1] = y1;
-	
-	drawFilledTrapezium(renderer, points, segment.colorGrass);
-		
-	points[0][0] = x2-w2-r2;	points[0][1] = y2;
-	points[1][0] = x2-w2;		points[1][1] = y2;
-	points[2][0] = x1-w1;	 	points[2][1] = y1;
-	points[3][0] = x1-w1-r1;	points[3][1] = y1;
-	
-	drawFilledTrapezium(renderer, points, segment.colorRumble);
-	
-	points[0][0] = x2+w2+r2;	points[0][1] = y2;
-	points[1][0] = x2+w2;		points[1][1] = y2;
-	points[2][0] = x1+w1;	 	points[2][1] = y1;
-	points[3][0] = x1+w1+r1;	points[3][1] = y1;
-	
-	drawFilledTrapezium(renderer, points, segment.colorRumble);
-	
-	points[0][0] = x2-w2;		points[0][1] = y2;
-	points[1][0] = x2+w2;		points[1][1] = y2;
-	points[2][0] = x1+w1;	 	points[2][1] = y1;
-	points[3][0] = x1-w1;		points[3][1] = y1;
-	
-	drawFilledTrapezium(renderer, points, segment.colorRoad);
-	
-	float 	lane_w1 = w1 * 2 / numLanes,
-			lane_w2 = w2 * 2 / numLanes,
-			lane_x1 = x1 - w1 + lane_w1,
-			lane_x2 = x2 - w2 + lane_w2;
+endlessTrack::endlessTrack() {
+	this->enabled	= false;
+	this->cars		= 0;
+	this->generated	= 0;
+	this->next		= 0;
+	this->lastY		= 0;
+	this->state		= 1;
+	this->stride	= 0;
+}
 
-	if (segment.colorLane.a == 0xFF) {
-		SDL_SetRenderDrawColor(renderer, segment.colorLane.r, segment.colorLane.g, segment.colorLane.b, segment.colorLane.a);
-	
-		for (int lane = 1; lane < numLanes; lane_x1 += lane_w1, lane_x2 += lane_w2, lane++) {
-			points[0][0] = (lane_x2 - l2 / 2);	points[0][1] = y2;
-			points[1][0] = (lane_x2 + l2 / 2);	points[1][1] = y2;
-			points[2][0] = (lane_x1 + l1 / 2);	points[2][1] = y1;
-			points[3][0] = (lane_x1 - l1 / 2);	points[3][1] = y1;
+int endlessTrack::pick(int min, int max) {
+	this->state = this->state * 1103515245 + 12345;
+	return min + (int)((this->state >> 16) % (Uint32)(max - min + 1));
+}
+
+// Next piece of road into pending. The primitives append to segments, which is swapped with pending
+// meanwhile, so pieces start at y = 0 and place() moves them up to where the road got to. Hill heights
+// lean back towards the ground the further the road has wandered from it, and once too far away
+// the next piece is always a hill back down (or up).
+void endlessTrack::generate(void) {
+	int lengths[3] = { LENGTH_SHORT, LENGTH_MEDIUM, LENGTH_LONG },
+		curves[3]  = { CURVE_EASY, CURVE_MEDIUM, CURVE_HARD },
+		hills[4]   = { HILL_NONE, HILL_LOW, HILL_MEDIUM, HILL_HIGH },
+		drift	   = -(int)(this->lastY / segmentLength) / 2,
+		length	   = lengths[this->pick(0, 2)],
+		curve	   = curves[this->pick(0, 2)] * (this->pick(0, 1) ? 1 : -1),
+		height	   = hills[this->pick(0, 3)] * (this->pick(0, 1) ? 1 : -1) + drift;
+	// --
+	this->pending.clear();
+	this->next = 0;
+	segments.swap(this->pending);
+	switch ((abs(drift) > HILL_MEDIUM) ? 1 : this->pick(0, 6)) {
+		case 0:	addStraight(length);						break;
+		case 1:	addHill(length, height);					break;
+		case 2:	addCurve(length, curve, height);			break;
+		case 3:	addCurve(length, curve, drift);				break;
+		case 4:	addLowRollingHills(LENGTH_SHORT, HILL_LOW);	break;
+		case 5:	addSCurves();								break;
+		case 6:	addBumps();									break;
+	}
+	segments.swap(this->pending);
+}
 
-			drawFilledTrapezium(renderer, points, segment.colorLane);
+// Next pending segment into the ring, over the slot of the one segments.size() behind it, with its roadside sprites
+void endlessTrack::place(void) {
+	SDL_Rect  plants[12] = { TREE1_SPRITE, TREE2_SPRITE, DEAD_TREE1_SPRITE, DEAD_TREE2_SPRITE, PALM_TREE_SPRITE, BUSH1_SPRITE, BUSH2_SPRITE, CACTUS_SPRITE, STUMP_SPRITE, BOULDER1_SPRITE, BOULDER2_SPRITE, BOULDER3_SPRITE},
+			  billboards[9] = { BILLBOARD01_SPRITE, BILLBOARD02_SPRITE, BILLBOARD03_SPRITE, BILLBOARD04_SPRITE, BILLBOARD05_SPRITE, BILLBOARD06_SPRITE, BILLBOARD07_SPRITE, BILLBOARD08_SPRITE, BILLBOARD09_SPRITE};
+	Sprite	  sprite;
+	int		  slot = this->generated % segments.size();
+	// --
+	if (this->next == this->pending.size())
+		this->generate();
+	const Segment & piece = this->pending[this->next++];
+	Segment & segment = segments[slot];
+	segment.curve	 = piece.curve;
+	segment.p1worldY = this->lastY;
+	segment.p2worldY = this->lastY + piece.p2worldY - piece.p1worldY;
+	setPalette(segment, ((this->generated == 2) || (this->generated == 3)) ? PALETTE_START : (((this->generated / rumbleLength) % 2 == 1) ? PALETTE_LIGHT : PALETTE_DARK));
+	this->slotCount[slot] = 0;
+	if (this->generated % 3 == 0)
+		for (int n = 0; n < spriteDensity; n++) {
+			sprite.spriteRect = plants[this->pick(0, 11)];
+			sprite.x_offset	  = (this->pick(0, 1) ? 1 : -1) * (2 + this->pick(0, 500) / 100.0);
+			this->slotSprites[slot * this->stride + this->slotCount[slot]++] = sprite;
 		}
+	if (this->generated % 100 == 50) {
+		sprite.spriteRect = billboards[this->pick(0, 8)];
+		sprite.x_offset	  = (this->pick(0, 1) ? 1.2 : -1.2);
+		this->slotSprites[slot * this->stride + this->slotCount[slot]++] = sprite;
 	}
+	this->lastY = segment.p2worldY;
+	this->generated++;
+}
 
-	//SDL_Rect rect = {.x = 0, .y = y1, .w = SCREEN_WIDTH, .h = y2 - y1};
-	SDL_Rect rect = {.x = 0, .y = (int)y1, .w = SCREEN_WIDTH, .h = (int)(y2 - y1)};
+// The ring is drawDistance segments plus the traffic look-ahead in front of the player and a margin
+// behind, for the interpolated frame and the odd knock back from a collision. The traffic is the
+// one of a stretch of road that long.
+void endlessTrack::start(Uint32 seed) {
+	this->enabled	= true;
+	this->state		= seed;
+	this->generated	= 0;
+	this->lastY		= 0;
+	this->pending.clear();
+	this->next		= 0;
+	segments.clear();
+	segments.resize(drawDistance + 64 + 64);
+	this->cars = segments.size() / 32; // about the traffic density of the built-in track
+	this->stride = spriteDensity + 1;
+	this->slotSprites.resize(segments.size() * this->stride);
+	this->slotCount.assign(segments.size(), 0);
+	for (int i = 0; i < segments.size(); i++) {
+		segments[i].index	 = i;
+		segments[i].p1worldX = 0.0;
+		segments[i].p2worldX = 0.0;
+		segments[i].p1worldZ = i * segmentLength;
+		segments[i].p2worldZ = (i + 1) * segmentLength;
+		this->place();
+	}
+	trackLength = segments.size() * segmentLength;
+	roadCurves.build();
+	roadside.clear();
+	this->storeSprites(0);
+}
+
+// Copies the sprites of the slots from the given one to the end of the ring into roadside. The
+// slots before it keep their place in it, so only the offsets from there on change. largest only
+// ever grows here, which is still a safe bound for skipping sprites.
+void endlessTrack::storeSprites(int from) {
+	roadside.sprites.resize(roadside.first(from));
+	roadside.offsets.resize(segments.size() + 1);
+	roadside.offsets[0] = 0;
+	for (int slot = from; slot < segments.size(); slot++) {
+		for (int i = 0; i < this->slotCount[slot]; i++) {
+			const Sprite & sprite = this->slotSprites[slot * this->stride + i];
+			if (sprite.spriteRect.w > roadside.largest) roadside.largest = sprite.spriteRect.w;
+			if (sprite.spriteRect.h > roadside.largest) roadside.largest = sprite.spriteRect.h;
+			roadside.sprites.push_back(sprite);
+		}
+		roadside.offsets[slot + 1] = roadside.sprites.size();
+	}
+}
+
+// Refills the slots behind the player, position being the one just simulated. Curve sums, roadside
+// sprites and collision spans are only redone from the first refilled slot on, a handful of slots
+// at the end of the ring but for the tick that wraps round to slot 0.
+void endlessTrack::advance(int position) {
+	int 	  slot	  = position / segmentLength,
+			  ahead	  = drawDistance + 64,
+			  from	  = segments.size();
+	long long current = this->generated - segments.size() + ((slot - this->generated % (long long)segments.size() + segments.size()) % segments.size());
+	// --
+	while (this->generated - current < ahead) {
+		if (this->generated % segments.size() < from)
+			from = this->generated % segments.size();
+		this->place();
+	}
+	if (from < segments.size()) {
+		roadCurves.build(from);
+		this->storeSprites(from);
+		spriteCollision.build(from);
+	}
+}
+
+endlessTrack endless;
+
+// -- Assets ----------------------------------------------------------------------------
+// Images are decoded on worker threads while the main thread goes on setting up the game, and
+// turned into textures on the render thread as each one finishes (SDL renderers are not thread
+// safe). The decoded pixels are kept in a cache folder of the user (SDL_GetPrefPath, the game folder
+// only when there is none) under a hash of the file contents: later starts map them back instead of
+// decoding the PNG again, and a changed file simply gets a new entry.
+#define ASSET_CACHE_MAGIC		0x41545A43			// "CZTA"
+#define ASSET_CACHE_VERSION		1
+#define ASSET_CACHE_DIR			"cache"
+
+class assetHeader {
+	public:
+		Uint32 magic, version, width, height;		// followed by width * height ARGB8888 pixels
+};
+
+class assetLoader {
+	public:
+		assetLoader();
+		int  request(const char * filename);
+		void start(int numThreads);
+		int  upload(SDL_Renderer * renderer, bool wait);
+		void finish(SDL_Renderer * renderer);
+		SDL_Texture * texture(int asset);
+		bool useCache;
+		int  fromCache, decoded, failed;
+	private:
+		class asset {
+			public:
+				std::string	  filename;
+				SDL_Surface * surface;
+				SDL_Texture * texture;
+				const char  * mapped;			// cache entry the surface points into
+				size_t		  mappedSize;
+				bool		  cached;
+		};
+		std::vector<asset>		  assets;
+		std::vector<int>		  finished;
+		std::vector<SDL_Thread *> threads;
+		SDL_sem *				  ready;
+		SDL_atomic_t			  next, numFinished;
+		int						  uploaded;
+		std::string				  cacheDir;
+		void load(int index);
+		static int work(void * data);
+};
+
+assetLoader::assetLoader() {
+	this->useCache	= true;
+	this->fromCache	= 0;
+	this->decoded	= 0;
+	this->failed	= 0;
+	this->ready		= NULL;
+	this->uploaded	= 0;
+	SDL_AtomicSet(&this->next, 0);
+	SDL_AtomicSet(&this->numFinished, 0);
+}
+
+// Returns the handle of the asset, every request must come before start()
+int assetLoader::request(const char * filename) {
+	asset image;
+	// --
+	image.filename	 = filename;
+	image.surface	 = NULL;
+	image.texture	 = NULL;
+	image.mapped	 = NULL;
+	image.mappedSize = 0;
+	image.cached	 = false;
+	this->assets.push_back(image);
+	return this->assets.size() - 1;
+}
+
+void assetLoader::start(int numThreads) {
+	if (this->useCache == true) {
+		char * prefPath = SDL_GetPrefPath("omotto", "CrazzyRace");
+		// --
+		this->cacheDir = (prefPath != NULL) ? std::string(prefPath) + ASSET_CACHE_DIR : std::string(ASSET_CACHE_DIR);
+		SDL_free(prefPath);
+#ifdef _WIN32
+		CreateDirectoryA(this->cacheDir.c_str(), NULL);
+#else
+		mkdir(this->cacheDir.c_str(), 0755);
+#endif
+	}
+	this->ready = SDL_CreateSemaphore(0);
+	this->finished.resize(this->assets.size());
+	if (numThreads > this->assets.size()) numThreads = this->assets.size();
+	for (int i = 0; i < numThreads; i++)
+		this->threads.push_back(SDL_CreateThread(assetLoader::work, "assets", this));
+}
+
+int assetLoader::work(void * data) {
+	assetLoader * loader = (assetLoader *)data;
+	int 		  index;
+	// --
+	while ((index = SDL_AtomicAdd(&loader->next, 1)) < loader->assets.size()) {
+		loader->load(index);
+		loader->finished[SDL_AtomicAdd(&loader->numFinished, 1)] = index;
+		SDL_SemPost(loader->ready);
+	}
+	return 0;
+}
+
+// On a worker thread; surface stays NULL when the file can not be read or decoded
+void assetLoader::load(int index) {
+	asset & 	  image = this->assets[index];
+	size_t		  size;
+	const char	* data = mapFile(image.filename.c_str(), &size);
+	Uint64		  hash = 14695981039346656037ULL;			// FNV-1a
+	assetHeader	  header;
+	SDL_Surface	* surface;
+	FILE		* file;
+	char		  entryName[32];
+	std::string	  cacheName, tempName;
+	// --
+	if (data == NULL)
+		return;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ (Uint8)data[i]) * 1099511628211ULL;
+	sprintf(entryName, "/%08x%08x.argb", (Uint32)(hash >> 32), (Uint32)hash);
+	cacheName = this->cacheDir + entryName;
+	if (this->useCache == true) {
+		image.mapped = mapFile(cacheName.c_str(), &image.mappedSize);
+		if ((image.mapped != NULL) && (image.mappedSize >= sizeof(header))) {
+			memcpy(&header, image.mapped, sizeof(header));
+			if ((header.magic == ASSET_CACHE_MAGIC) && (header.version == ASSET_CACHE_VERSION) &&
+				(image.mappedSize == sizeof(header) + (size_t)header.width * header.height * 4))
+				image.surface = SDL_CreateRGBSurfaceWithFormatFrom((void *)(image.mapped + sizeof(header)), header.width, header.height, 32, header.width * 4, SDL_PIXELFORMAT_ARGB8888);
+			if (image.surface != NULL) {
+				image.cached = true;
+				unmapFile(data, size);
+				return;
+			}
+		}
+		if (image.mapped != NULL) {
+			unmapFile(image.mapped, image.mappedSize);
+			image.mapped = NULL;
+		}
+	}
+	surface = IMG_Load_RW(SDL_RWFromConstMem(data, size), 1);
+	unmapFile(data, size);
+	if (surface == NULL)
+		return;
+	image.surface = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+	SDL_FreeSurface(surface);
+	if ((this->useCache == false) || (image.surface == NULL))
+		return;
+	// -- Written aside and renamed, so a half written entry is never picked up
+	sprintf(entryName, ".%d.tmp", index);
+	tempName = cacheName + entryName;
+	file = fopen(tempName.c_str(), "wb");
+	if (file == NULL)
+		return;
+	header.magic	= ASSET_CACHE_MAGIC;
+	header.version	= ASSET_CACHE_VERSION;
+	header.width	= image.surface->w;
+	header.height	= image.surface->h;
+	bool written = (fwrite(&header, sizeof(header), 1, file) == 1);
+	for (int y = 0; (y < image.surface->h) && (written == true); y++)
+		written = (fwrite((Uint8 *)image.surface->pixels + y * image.surface->pitch, image.surface->w * 4, 1, file) == 1);
+	fclose(file);
+	if ((written == false) || (rename(tempName.c_str(), cacheName.c_str()) != 0))
+		remove(tempName.c_str());		// or another run got there first
+}
+
+// Makes textures of the images decoded so far (all of them when wait), returns how many are left
+int assetLoader::upload(SDL_Renderer * renderer, bool wait) {
+	while (this->uploaded < this->assets.size()) {
+		if (wait == true)
+			SDL_SemWait(this->ready);
+		else if (SDL_SemTryWait(this->ready) != 0)
+			break;
+		asset & image = this->assets[this->finished[this->uploaded++]];
+		if (image.surface == NULL) {
+			this->failed++;
+			continue;
+		}
+		image.texture = SDL_CreateTextureFromSurface(renderer, image.surface);
+		if (image.cached == true) this->fromCache++; else this->decoded++;
+		SDL_FreeSurface(image.surface);
+		image.surface = NULL;
+		if (image.mapped != NULL) {
+			unmapFile(image.mapped, image.mappedSize);
+			image.mapped = NULL;
+		}
+	}
+	return this->assets.size() - this->uploaded;
+}
+
+void assetLoader::finish(SDL_Renderer * renderer) {
+	this->upload(renderer, true);
+	for (int i = 0; i < this->threads.size(); i++)
+		SDL_WaitThread(this->threads[i], NULL);
+	this->threads.clear();
+	if (this->ready != NULL) {
+		SDL_DestroySemaphore(this->ready);
+		this->ready = NULL;
+	}
+}
+
+// NULL until uploaded or when loading failed; the caller owns the texture
+SDL_Texture * assetLoader::texture(int asset) {
+	return this->assets[asset].texture;
+}
+
+// Every file under dir, sorted so the result does not depend on the directory order
+void listFiles(const std::string & dir, std::vector<std::string> & files) {
+	std::vector<std::string> entries;
+	DIR 		  * folder = opendir(dir.c_str());
+	struct dirent * entry;
+	// --
+	if (folder == NULL)
+		return;
+	while ((entry = readdir(folder)) != NULL)
+		if (entry->d_name[0] != '.')
+			entries.push_back(dir + "/" + entry->d_name);
+	closedir(folder);
+	std::sort(entries.begin(), entries.end());
+	for (int i = 0; i < entries.size(); i++) {
+		DIR * child = opendir(entries[i].c_str());
+		if (child != NULL) {
+			closedir(child);
+			listFiles(entries[i], files);
+		} else
+			files.push_back(entries[i]);
+	}
+}
+
+bool hasExtension(const std::string & file, const char * extension) {
+	return (file.size() > strlen(extension)) && (strcasecmp(file.c_str() + file.size() - strlen(extension), extension) == 0);
+}
+
+// -- Atlas packer ----------------------------------------------------------------------
+// A build step, run from the game folder before compiling with -DATLAS:
+//   CrazzyRace --pack-atlas [maxSize]
+// Packs every image the game may draw in as few power of two pages of up to maxSize x maxSize
+// (4096 by default) as they fit: first the rects of sheetSprites, which must all land on page 0,
+// then the sprites the SpriteSheetPacker manifests list (images/**/sheet.txt, one "name = x y w h"
+// per line over sheet.png) and last the loose images under images/ no manifest lists. Writes the
+// pages to atlas0.png, atlas1.png... and their rects to atlas.h: the sheetSprites constants by
+// name, plus an ATLAS_<FOLDER>_<NAME> id and an atlasSprites entry for every sprite.
+#ifndef ATLAS
+class atlasEntry {
+	public:
+		std::string name, file;		// id in atlas.h, image cut from
+		SDL_Rect	source, rect;
+		int			group, page;
+		// Shelves pack best from the tallest down, groups go in order
+		bool operator < (const atlasEntry & other) const {
+			if (this->group != other.group) return this->group < other.group;
+			if (this->source.h != other.source.h) return this->source.h > other.source.h;
+			return this->source.w > other.source.w;
+		}
+};
+
+// ATLAS_ followed by folder and name in capitals, anything else than letters and digits as _
+std::string atlasId(const std::string & folder, const std::string & name) {
+	std::string id = "ATLAS_" + folder + (folder.size() > 0 ? "_" : "") + name;
+	for (int i = 0; i < id.size(); i++)
+		id[i] = isalnum(id[i]) ? toupper(id[i]) : '_';
+	return id;
+}
+
+void addAtlasEntry(std::vector<atlasEntry> & entries, const std::string & name, const std::string & file, SDL_Rect source, int group) {
+	atlasEntry entry;
+	// --
+	entry.name	 = name;
+	entry.file	 = file;
+	entry.source = source;
+	entry.group	 = group;
+	entry.page	 = -1;
+	for (int i = 0, copy = 2; i < entries.size(); i++)
+		if (entries[i].name == entry.name) {
+			char unique[160];
+			sprintf(unique, "%.150s_%d", name.c_str(), copy++);
+			entry.name = unique;
+			i = -1;
+		}
+	entries.push_back(entry);
+}
+
+bool isPacked(const atlasEntry & entry) {
+	return entry.page >= 0;
+}
+
+int packAtlas(int maxSize) {
+	const int 	padding = 2;			// transparent, so filtering never bleeds a neighbour in
+	std::vector<std::string> 	files;
+	std::vector<atlasEntry> 	entries;
+	std::vector<SDL_Rect>		pages;	// used size of each
+	std::map<std::string, SDL_Surface *> images;
+	std::map<std::string, bool> listed;
+	int 	x = padding, y = padding, shelf = 0, page = 0;
+	char	line[256], name[128];
+	SDL_Rect source;
+	// --
+	IMG_Init(IMG_INIT_PNG | IMG_INIT_JPG);
+	// -- Sprites the game draws, sprites in manifests, loose images
+	for (int i = 0; i < sizeof(sheetSprites) / sizeof(sheetSprites[0]); i++)
+		addAtlasEntry(entries, std::string("ATLAS_") + sheetSprites[i].name, sheetSprites[i].sheet, *sheetSprites[i].rect, 0);
+	listFiles("images", files);
+	for (int i = 0; i < files.size(); i++) {
+		if (hasExtension(files[i], ".txt") == false)
+			continue;
+		std::string base   = files[i].substr(0, files[i].size() - 4),
+					folder = base.substr(strlen("images/"), base.rfind('/') - strlen("images/"));
+		std::ifstream manifest(files[i].c_str());
+		listed[base + ".png"] = true;
+		while (manifest.getline(line, sizeof(line)))
+			if (sscanf(line, "%127s = %d %d %d %d", name, &source.x, &source.y, &source.w, &source.h) == 5) {
+				addAtlasEntry(entries, atlasId(folder, name), base + ".png", source, 1);
+				listed[base.substr(0, base.rfind('/') + 1) + name + ".png"] = true;
+			}
+	}
+	for (int i = 0; i < files.size(); i++) {
+		if (((hasExtension(files[i], ".png") == false) && (hasExtension(files[i], ".jpg") == false)) || (listed.count(files[i]) > 0))
+			continue;
+		std::string folder = files[i].substr(strlen("images/"), files[i].rfind('/') - strlen("images/")),
+					base   = files[i].substr(files[i].rfind('/') + 1, files[i].size() - files[i].rfind('/') - 5);
+		source.x = source.y = source.w = source.h = 0;				// whole image, once loaded
+		addAtlasEntry(entries, atlasId((folder == "images") ? "" : folder, base), files[i], source, 2);
+	}
+
+	// -- Sources, converted once per file
+	for (int i = 0; i < entries.size(); i++) {
+		if (images.count(entries[i].file) == 0) {
+			SDL_Surface * image = IMG_Load(entries[i].file.c_str());
+			images[entries[i].file] = (image != NULL) ? SDL_ConvertSurfaceFormat(image, SDL_PIXELFORMAT_ARGB8888, 0) : NULL;
+			SDL_FreeSurface(image);
+		}
+		SDL_Surface * image = images[entries[i].file];
+		if (image == NULL) {
+			std::cout << "pack-atlas: can not load " << entries[i].file << ", " << entries[i].name << " left out" << std::endl;
+			entries[i].source.w = 0;
+			continue;
+		}
+		if (entries[i].source.w == 0) {
+			entries[i].source.w = image->w;
+			entries[i].source.h = image->h;
+		}
+		if ((entries[i].source.x < 0) || (entries[i].source.y < 0) || (entries[i].source.x + entries[i].source.w > image->w) || (entries[i].source.y + entries[i].source.h > image->h)) {
+			std::cout << "pack-atlas: " << entries[i].name << " goes out of " << entries[i].file << ", left out" << std::endl;
+			entries[i].source.w = 0;
+		}
+	}
+
+	// -- Shelves, a new page when one is full
+	std::stable_sort(entries.begin(), entries.end());
+	source.x = source.y = source.w = source.h = 0;
+	pages.push_back(source);
+	for (int i = 0; i < entries.size(); i++) {
+		atlasEntry & entry = entries[i];
+		if (entry.source.w == 0)
+			continue;
+		if ((entry.source.w + 2 * padding > maxSize) || (entry.source.h + 2 * padding > maxSize)) {
+			std::cout << "pack-atlas: " << entry.name << " (" << entry.source.w << "x" << entry.source.h << ") is larger than a page, left out" << std::endl;
+			continue;
+		}
+		if (x + entry.source.w + padding > maxSize) {
+			x 	   = padding;
+			y 	  += shelf + padding;
+			shelf  = 0;
+		}
+		if (y + entry.source.h + padding > maxSize) {
+			x = y = padding;
+			shelf = 0;
+			page++;
+			pages.push_back(source);
+		}
+		entry.page	 = page;
+		entry.rect	 = entry.source;
+		entry.rect.x = x;
+		entry.rect.y = y;
+		x += entry.source.w + padding;
+		if (entry.source.h > shelf) shelf = entry.source.h;
+		if (x > pages[page].w) pages[page].w = x;
+		if (y + entry.source.h + padding > pages[page].h) pages[page].h = y + entry.source.h + padding;
+	}
+	for (int i = 0; i < entries.size(); i++)
+		if ((entries[i].group == 0) && (entries[i].page != 0)) {
+			std::cout << "pack-atlas: " << entries[i].name << " is not on page 0, the game sprites must fit one " << maxSize << "x" << maxSize << " page" << std::endl;
+			return 1;
+		}
+
+	// -- Pages, power of two sized
+	std::vector<SDL_Surface *> surfaces(pages.size());
+	for (int i = 0; i < pages.size(); i++) {
+		int w = 1, h = 1;
+		while (w < pages[i].w) w *= 2;
+		while (h < pages[i].h) h *= 2;
+		surfaces[i] = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888);		// transparent
+		pages[i].w	= w;
+		pages[i].h	= h;
+	}
+	for (int i = 0; i < entries.size(); i++) {
+		if (entries[i].page < 0)
+			continue;
+		SDL_Surface * image = images[entries[i].file],
+					* target = surfaces[entries[i].page];
+		for (int row = 0; row < entries[i].source.h; row++)
+			memcpy((Uint8 *)target->pixels + (entries[i].rect.y + row) * target->pitch + entries[i].rect.x * 4,
+				   (Uint8 *)image->pixels + (entries[i].source.y + row) * image->pitch + entries[i].source.x * 4, entries[i].source.w * 4);
+	}
+	for (int i = 0; i < surfaces.size(); i++) {
+		char pageName[32];
+		sprintf(pageName, "atlas%d.png", i);
+		if (IMG_SavePNG(surfaces[i], pageName) != 0) {
+			std::cout << "pack-atlas: can not write " << pageName << ": " << IMG_GetError() << std::endl;
+			return 1;
+		}
+		std::cout << pageName << ": " << pages[i].w << "x" << pages[i].h << std::endl;
+		SDL_FreeSurface(surfaces[i]);
+	}
+	for (std::map<std::string, SDL_Surface *>::iterator image = images.begin(); image != images.end(); image++)
+		SDL_FreeSurface(image->second);
+
+	// -- atlas.h
+	std::ofstream header("atlas.h");
+	header << "// Generated by CrazzyRace --pack-atlas, do not edit: pack again instead" << std::endl << std::endl;
+	header << "#define ATLAS_PAGES\t" << pages.size() << std::endl << std::endl;
+	header << "const char * const atlasPages[ATLAS_PAGES] = {";
+	for (int i = 0; i < pages.size(); i++)
+		header << (i > 0 ? ", " : " ") << "\"atlas" << i << ".png\"";
+	header << " };" << std::endl << std::endl;
+	header << "// The sprites and backgrounds the game draws, all on page 0" << std::endl;
+	for (int i = 0; i < entries.size(); i++)
+		if (entries[i].group == 0)
+			header << "const SDL_Rect " << entries[i].name.substr(strlen("ATLAS_")) << " = { .x = " << entries[i].rect.x << ", .y = " << entries[i].rect.y
+				   << ", .w = " << entries[i].rect.w << ", .h = " << entries[i].rect.h << " };" << std::endl;
+	header << std::endl << "enum {" << std::endl;
+	for (int i = 0; i < entries.size(); i++)
+		if (entries[i].page >= 0)
+			header << "\t" << entries[i].name << "," << std::endl;
+	header << "\tNUM_ATLAS_SPRITES" << std::endl << "};" << std::endl << std::endl;
+	header << "const atlasSprite atlasSprites[NUM_ATLAS_SPRITES] = {" << std::endl;
+	for (int i = 0; i < entries.size(); i++)
+		if (entries[i].page >= 0)
+			header << "\t{ " << entries[i].page << ", { .x = " << entries[i].rect.x << ", .y = " << entries[i].rect.y << ", .w = " << entries[i].rect.w
+				   << ", .h = " << entries[i].rect.h << " } },\t\t// " << entries[i].file << std::endl;
+	header << "};" << std::endl;
+	IMG_Quit();
+	std::cout << "atlas.h: " << std::count_if(entries.begin(), entries.end(), isPacked) << " sprites in " << pages.size() << " pages" << std::endl;
+	return 0;
+}
+#endif
+
+// -- Audio ---------------------------------------------------------------------------------
+// Music and sound effects from images/music. Music is every .ogg there but the effects, played in
+// name order over and over. SDL_mixer streams each track from disk as it plays; a music thread
+// opens the next one (the part that hits the disk) while the current one plays and starts it from
+// the finished hook, so only two tracks are ever open and the switch costs no more than an audio
+// buffer. Effects are decoded once at start and mixed over the music by a pool of voices in the
+// post mix callback. The game thread triggers them through a single producer ring, so it never
+// takes the audio lock; when all voices are busy the one closest to its end is taken.
+enum { SFX_BIG_CRASH, SFX_SMALL_CRASH, SFX_PASS, NUM_SFX };
+
+#define MUSIC_DIR	"images/music"
+
+const char * sfxFiles[NUM_SFX] = { MUSIC_DIR "/BigCrash.ogg", MUSIC_DIR "/SmallCrash.ogg", MUSIC_DIR "/Pass.ogg" };
+
+class audioEngine {
+	public:
+		audioEngine();
+		bool open(void);
+		void close(void);
+		void play(int sfx, int volume);			// volume up to MIX_MAX_VOLUME
+		bool enabled;
+		int  dropped;							// triggers lost to a full ring
+	private:
+		class voice {
+			public:
+				const Mix_Chunk * chunk;		// NULL when free
+				Uint32 			  position;		// in bytes
+				int 			  volume;
+		};
+		class trigger {
+			public:
+				int sfx, volume;
+		};
+		static const int 		 numVoices = 16;
+		static const Uint32		 retrigger = 250;	// ms before an effect plays again, a car stuck on a tree hits it every tick
+		static const int 		 ringSize  = 64;
+		Mix_Chunk *				 samples[NUM_SFX];
+		Uint32					 lastPlayed[NUM_SFX];
+		voice 					 voices[numVoices];
+		trigger 				 ring[ringSize];
+		SDL_atomic_t 			 written, read;	// by the game thread, by the audio thread
+		std::vector<std::string> playlist;
+		int 					 track;
+		SDL_Thread *			 thread;
+		SDL_sem *				 finished;
+		bool 					 quit;
+		Mix_Music * openNext(void);
+		static int streamMusic(void * data);
+		static void musicFinished(void);
+		static void mixVoices(void * data, Uint8 * stream, int length);
+};
+
+audioEngine::audioEngine() {
+	this->enabled  = false;
+	this->dropped  = 0;
+	this->track	   = 0;
+	this->thread   = NULL;
+	this->finished = NULL;
+	this->quit	   = false;
+	for (int i = 0; i < NUM_SFX; i++) {
+		this->samples[i]	= NULL;
+		this->lastPlayed[i] = 0;
+	}
+	for (int i = 0; i < numVoices; i++)
+		this->voices[i].chunk = NULL;
+	SDL_AtomicSet(&this->written, 0);
+	SDL_AtomicSet(&this->read, 0);
+}
+
+// Effects are mixed as 16 bit samples, the format asked for; music plays whatever the device took
+bool audioEngine::open(void) {
+	std::vector<std::string> files;
+	int 	frequency, channels;
+	Uint16	format;
+	// --
+	Mix_Init(MIX_INIT_OGG);
+	if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 1024) != 0) {
+		std::cout << "Mix_OpenAudio Error: " << Mix_GetError() << std::endl;
+		return false;
+	}
+	Mix_QuerySpec(&frequency, &format, &channels);
+	if (format == AUDIO_S16SYS) {
+		for (int i = 0; i < NUM_SFX; i++)
+			if ((this->samples[i] = Mix_LoadWAV(sfxFiles[i])) == NULL)
+				std::cout << "Mix_LoadWAV Error: " << Mix_GetError() << std::endl;
+		Mix_SetPostMix(audioEngine::mixVoices, this);
+	}
+	listFiles(MUSIC_DIR, files);
+	for (int i = 0; i < files.size(); i++)
+		if ((hasExtension(files[i], ".ogg") == true) && (std::find(sfxFiles, sfxFiles + NUM_SFX, files[i]) == sfxFiles + NUM_SFX))
+			this->playlist.push_back(files[i]);
+	if (this->playlist.size() > 0) {
+		this->quit	   = false;
+		this->finished = SDL_CreateSemaphore(1);		// the first track starts right away
+		Mix_HookMusicFinished(audioEngine::musicFinished);
+		this->thread   = SDL_CreateThread(audioEngine::streamMusic, "music", this);
+	}
+	this->enabled = true;
+	return true;
+}
+
+void audioEngine::close(void) {
+	if (this->enabled == false)
+		return;
+	this->enabled = false;
+	if (this->thread != NULL) {
+		Mix_HookMusicFinished(NULL);
+		this->quit = true;
+		SDL_SemPost(this->finished);
+		SDL_WaitThread(this->thread, NULL);
+		SDL_DestroySemaphore(this->finished);
+		this->thread   = NULL;
+		this->finished = NULL;
+	}
+	Mix_SetPostMix(NULL, NULL);
+	Mix_CloseAudio();
+	for (int i = 0; i < NUM_SFX; i++)
+		if (this->samples[i] != NULL) {
+			Mix_FreeChunk(this->samples[i]);
+			this->samples[i] = NULL;
+		}
+	for (int i = 0; i < numVoices; i++)
+		this->voices[i].chunk = NULL;
+	Mix_Quit();
+}
+
+// From the game thread only. Nothing happens until the next audio buffer is mixed.
+void audioEngine::play(int sfx, int volume) {
+	int written = SDL_AtomicGet(&this->written);
+	// --
+	if ((this->enabled == false) || (this->samples[sfx] == NULL) || (SDL_GetTicks() - this->lastPlayed[sfx] < retrigger))
+		return;
+	this->lastPlayed[sfx] = SDL_GetTicks();
+	if (written - SDL_AtomicGet(&this->read) >= ringSize) {
+		this->dropped++;
+		return;
+	}
+	this->ring[written % ringSize].sfx	  = sfx;
+	this->ring[written % ringSize].volume = volume;
+	SDL_AtomicSet(&this->written, written + 1);
+}
+
+// The next track in the playlist, skipping the ones that fail to open (NULL if none opens)
+Mix_Music * audioEngine::openNext(void) {
+	Mix_Music * music = NULL;
+	// --
+	for (int i = 0; (i < this->playlist.size()) && (music == NULL); i++) {
+		music = Mix_LoadMUS(this->playlist[this->track].c_str());
+		if (music == NULL)
+			std::cout << "Mix_LoadMUS Error: " << this->playlist[this->track] << ": " << Mix_GetError() << std::endl;
+		this->track = (this->track + 1) % this->playlist.size();
+	}
+	return music;
+}
+
+int audioEngine::streamMusic(void * data) {
+	audioEngine * engine  = (audioEngine *)data;
+	Mix_Music	* current = NULL,
+				* next	  = NULL;
+	// --
+	while (1) {
+		if (next == NULL)
+			next = engine->openNext();
+		SDL_SemWait(engine->finished);
+		if ((engine->quit == true) || (next == NULL))
+			break;
+		Mix_PlayMusic(next, 1);
+		if (current != NULL)
+			Mix_FreeMusic(current);
+		current = next;
+		next	= NULL;
+	}
+	Mix_HaltMusic();
+	if (current != NULL) Mix_FreeMusic(current);
+	if (next != NULL) 	 Mix_FreeMusic(next);
+	return 0;
+}
+
+void audioEngine::mixVoices(void * data, Uint8 * stream, int length) {
+	audioEngine * engine  = (audioEngine *)data;
+	Sint16 		* out	  = (Sint16 *)stream;
+	int			  read	  = SDL_AtomicGet(&engine->read),
+				  written = SDL_AtomicGet(&engine->written),
+				  samples = length / 2;
+	// -- Start the new triggers
+	for (; read != written; read++) {
+		const trigger & sound = engine->ring[read % ringSize];
+		voice * target = &engine->voices[0];
+		for (int i = 0; i < numVoices; i++) {
+			if (engine->voices[i].chunk == NULL) {
+				target = &engine->voices[i];
+				break;
+			}
+			if (engine->voices[i].chunk->alen - engine->voices[i].position < target->chunk->alen - target->position)
+				target = &engine->voices[i];
+		}
+		target->chunk	 = engine->samples[sound.sfx];
+		target->position = 0;
+		target->volume	 = sound.volume;
+	}
+	SDL_AtomicSet(&engine->read, read);
+	// -- Add the voices playing, saturated
+	for (int i = 0; i < numVoices; i++) {
+		voice & sound = engine->voices[i];
+		if (sound.chunk == NULL)
+			continue;
+		const Sint16 * source = (const Sint16 *)(sound.chunk->abuf + sound.position);
+		int count = (sound.chunk->alen - sound.position) / 2;
+		if (count > samples) count = samples;
+		for (int n = 0; n < count; n++) {
+			int mixed = out[n] + ((source[n] * sound.volume) >> 7);
+			out[n] = (mixed > 32767) ? 32767 : ((mixed < -32768) ? -32768 : mixed);
+		}
+		sound.position += count * 2;
+		if (sound.position >= sound.chunk->alen)
+			sound.chunk = NULL;
+	}
+}
+
+audioEngine audio;
+
+// Called by SDL_mixer from the audio thread, which must not start music itself
+void audioEngine::musicFinished(void) {
+	SDL_SemPost(audio.finished);
+}
+
+// --------------------------------------------------------------------------------------
+
+// update() only depends on its input and on the world it starts from, so a replay holds just that:
+// the seed, the track (a file, an endless seed or the built-in road), the tick length and the keys
+// of every tick. Every keyframeInterval ticks it also holds the player and traffic state at the
+// start of the tick, checked when playing back to tell the first tick a change made the run diverge,
+// and every poseInterval ticks in between the player's alone, which ghosts are drawn from.
+// The body is a byte stream:
+//   0rrrkkkk	keys k (1 up, 2 down, 4 left, 8 right) held for r + 1 ticks
+//   0x80 ...	keyframe: position and speed as zigzag varint deltas from the last keyframe or pose,
+//				playerX as a varint of its bits xored with the last ones, the number of cars, then
+//				the z delta and the xored x bits of every car
+//   0x81 ...	pose: position and playerX, coded the same
+#define REPLAY_MAGIC			0x525A5243	// "CRZR"
+#define REPLAY_VERSION			2
+#define REPLAY_KEYFRAME			0x80
+#define REPLAY_POSE				0x81
+#define REPLAY_MAX_RUN			8
+
+class replayHeader {
+	public:
+		Uint32	magic, version;
+		Uint32	seed, endlessSeed;
+		float	tickLength;
+		Uint32	ticks, keyframeInterval, poseInterval;
+		char	track[64];					// empty for the built-in road or an endless one
+};
+
+// Builds the world a run starts from: roadside sprites and traffic drawn from seed, the road from
+// a compiled track, an endless seed or the built-in layout. A track with its own traffic seed keeps it.
+bool buildWorld(Uint32 seed, Uint32 endlessSeed, const char * trackFile) {
+	seedRandom(seed);
+	if (endlessSeed != 0)
+		endless.start(endlessSeed);
+	else if (trackFile != NULL) {
+		if (loadTrack(trackFile) == false)
+			return false;
+	} else {
+		resetRoad();
+		resetSprites();
+	}
+	spriteCollision.build();
+	resetCars((endlessSeed != 0) ? endless.cars : totalCars);
+	return true;
+}
+
+class replayFile {
+	public:
+		replayFile();
+		bool start(Uint32 seed, Uint32 endlessSeed, const char * trackFile);
+		void record(int position, int speed, bool touchUp, bool touchDown, bool touchLeft, bool touchRight);
+		bool save(const char * filename);
+		bool load(const char * filename);
+		bool buildWorld(void);
+		bool play(int position, int speed, bool * touchUp, bool * touchDown, bool * touchLeft, bool * touchRight);
+		replayHeader header;
+		int 	tick,
+				keyframes,					// keyframes checked while playing
+				diverged;					// first tick not matching its keyframe, -1 while all match
+	private:
+		std::vector<Uint8>	data;
+		size_t	offset;
+		int		keys, run;
+		bool	recording;
+		int		lastPosition, lastSpeed;
+		Uint32	lastX;
+		std::vector<int>	lastCarZ;
+		std::vector<Uint32> lastCarX;
+		void	putVarint(Uint32 value);
+		Uint32	getVarint(void);
+		void	flushKeys(void);
+		bool	delta(int value, int * last);
+		bool	bits(float value, Uint32 * last);
+		bool	keyframe(int position, int speed);
+		bool	pose(int position);
+};
+
+replayFile::replayFile() {
+	memset(&this->header, 0, sizeof(this->header));
+	this->tick 		= 0;
+	this->keyframes	= 0;
+	this->diverged	= -1;
+	this->offset	= 0;
+	this->keys		= 0;
+	this->run		= 0;
+	this->recording	= false;
+	this->lastPosition = this->lastSpeed = 0;
+	this->lastX		= 0;
+}
+
+// Starts recording a run on the world buildWorld(seed, endlessSeed, trackFile) makes. The track path
+// is kept in the header to rebuild the world from, a longer one than it holds is refused.
+bool replayFile::start(Uint32 seed, Uint32 endlessSeed, const char * trackFile) {
+	if ((trackFile != NULL) && (strlen(trackFile) >= sizeof(this->header.track))) {
+		std::cout << "Track path " << trackFile << " is too long to record, at most " << sizeof(this->header.track) - 1 << " characters" << std::endl;
+		return false;
+	}
+	memset(&this->header, 0, sizeof(this->header));
+	this->header.magic			  = REPLAY_MAGIC;
+	this->header.version		  = REPLAY_VERSION;
+	this->header.seed			  = seed;
+	this->header.endlessSeed	  = endlessSeed;
+	this->header.tickLength		  = dt;
+	this->header.keyframeInterval = 300;
+	this->header.poseInterval	  = 6;
+	if (trackFile != NULL)
+		strcpy(this->header.track, trackFile);
+	this->recording = true;
+	return true;
+}
+
+void replayFile::putVarint(Uint32 value) {
+	while (value >= 0x80) {
+		this->data.push_back((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	this->data.push_back(value);
+}
+
+// Reads 0 past the end, the keyframe it belongs to then fails to match
+Uint32 replayFile::getVarint(void) {
+	Uint32 value = 0;
+	// --
+	for (int shift = 0; (shift < 35) && (this->offset < this->data.size()); shift += 7) {
+		value |= (Uint32)(this->data[this->offset] & 0x7F) << shift;
+		if ((this->data[this->offset++] & 0x80) == 0)
+			break;
+	}
+	return value;
+}
+
+void replayFile::flushKeys(void) {
+	if (this->run > 0)
+		this->data.push_back(((this->run - 1) << 4) | this->keys);
+	this->run = 0;
+}
+
+// Writes value as a zigzag delta from last, or reads one and tells whether value matches it
+bool replayFile::delta(int value, int * last) {
+	Uint32 zigzag;
+	// --
+	if (this->recording == true) {
+		zigzag = ((Uint32)(value - *last) << 1) ^ (Uint32)((value - *last) >> 31);
+		this->putVarint(zigzag);
+		*last = value;
+		return true;
+	}
+	zigzag = this->getVarint();
+	*last += (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+	return (*last == value);
+}
+
+// Same for a float, as its bits xored with the last ones: unchanged or close values take a byte or two
+bool replayFile::bits(float value, Uint32 * last) {
+	Uint32 raw;
+	// --
+	memcpy(&raw, &value, sizeof(raw));
+	if (this->recording == true) {
+		this->putVarint(raw ^ *last);
+		*last = raw;
+		return true;
+	}
+	*last ^= this->getVarint();
+	return (*last == raw);
+}
+
+bool replayFile::keyframe(int position, int speed) {
+	bool 	match = true;
+	size_t	count = traffic.cars.size();
+	// --
+	if (this->recording == true)
+		this->data.push_back(REPLAY_KEYFRAME);
+	else if ((this->offset >= this->data.size()) || (this->data[this->offset++] != REPLAY_KEYFRAME))
+		return false;
+	match = this->delta(position, &this->lastPosition) && match;
+	match = this->delta(speed, &this->lastSpeed) && match;
+	match = this->bits(playerX, &this->lastX) && match;
+	if (this->recording == true)
+		this->putVarint(count);
+	else {
+		count = this->getVarint();
+		match = (count == traffic.cars.size()) && match;
+	}
+	this->lastCarZ.resize(count, 0);
+	this->lastCarX.resize(count, 0);
+	for (size_t n = 0; n < count; n++) {
+		// -- A car missing from the world still has its fields read, against zeros
+		bool present = (n < traffic.cars.size());
+		match = this->delta(present ? traffic.cars[n].z_offset : 0, &this->lastCarZ[n]) && present && match;
+		match = this->bits(present ? traffic.cars[n].x_offset : 0, &this->lastCarX[n]) && present && match;
+	}
+	return match;
+}
+
+bool replayFile::pose(int position) {
+	bool match = true;
+	// --
+	if (this->recording == true)
+		this->data.push_back(REPLAY_POSE);
+	else if ((this->offset >= this->data.size()) || (this->data[this->offset++] != REPLAY_POSE))
+		return false;
+	match = this->delta(position, &this->lastPosition) && match;
+	match = this->bits(playerX, &this->lastX) && match;
+	return match;
+}
+
+// Adds a tick, given the state it starts from and the keys held through it
+void replayFile::record(int position, int speed, bool touchUp, bool touchDown, bool touchLeft, bool touchRight) {
+	int keys = (touchUp ? 1 : 0) | (touchDown ? 2 : 0) | (touchLeft ? 4 : 0) | (touchRight ? 8 : 0);
+	// --
+	if (this->tick % this->header.keyframeInterval == 0) {
+		this->flushKeys();
+		this->keyframe(position, speed);
+	} else if (this->tick % this->header.poseInterval == 0) {
+		this->flushKeys();
+		this->pose(position);
+	}
+	if ((this->run == REPLAY_MAX_RUN) || ((this->run > 0) && (keys != this->keys)))
+		this->flushKeys();
+	this->keys = keys;
+	this->run++;
+	this->tick++;
+}
+
+bool replayFile::save(const char * filename) {
+	this->flushKeys();
+	this->header.ticks = this->tick;
+	std::ofstream file(filename, std::ios::out | std::ios::binary);
+	if (!file)
+		return false;
+	file.write((const char *)&this->header, sizeof(this->header));
+	if (this->data.size() > 0)
+		file.write((const char *)&this->data[0], this->data.size());
+	return file.good();
+}
+
+bool validReplay(const char * filename, const replayHeader * header) {
+	if ((header->magic != REPLAY_MAGIC) || (header->version != REPLAY_VERSION) || (header->keyframeInterval == 0) || (header->poseInterval == 0)) {
+		std::cout << "Replay " << filename << " is not a version " << REPLAY_VERSION << " replay" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool replayFile::load(const char * filename) {
+	size_t		 size;
+	const char * data = mapFile(filename, &size);
+	// --
+	if (data == NULL) {
+		std::cout << "Replay " << filename << " could not be opened" << std::endl;
+		return false;
+	}
+	if ((size < sizeof(replayHeader)) || (validReplay(filename, (const replayHeader *)data) == false)) {
+		unmapFile(data, size);
+		return false;
+	}
+	memcpy(&this->header, data, sizeof(this->header));
+	this->header.track[sizeof(this->header.track) - 1] = '\0';
+	this->data.assign((const Uint8 *)data + sizeof(replayHeader), (const Uint8 *)data + size);
+	unmapFile(data, size);
+	this->recording = false;
+	return true;
+}
+
+// Builds the world of the replay and sets the tick length it was recorded with
+bool replayFile::buildWorld(void) {
+	dt = this->header.tickLength;
+	return ::buildWorld(this->header.seed, this->header.endlessSeed, (this->header.track[0] != '\0') ? this->header.track : NULL);
+}
+
+// Gives the keys of the next tick and checks the state it starts from when a keyframe or a pose
+// is due. False once every tick was played.
+bool replayFile::play(int position, int speed, bool * touchUp, bool * touchDown, bool * touchLeft, bool * touchRight) {
+	if (this->tick >= this->header.ticks)
+		return false;
+	if (this->tick % this->header.keyframeInterval == 0) {
+		this->keyframes++;
+		if ((this->keyframe(position, speed) == false) && (this->diverged < 0))
+			this->diverged = this->tick;
+	} else if ((this->tick % this->header.poseInterval == 0) && (this->pose(position) == false) && (this->diverged < 0))
+		this->diverged = this->tick;
+	if (this->run == 0) {
+		if ((this->offset >= this->data.size()) || (this->data[this->offset] & REPLAY_KEYFRAME)) {
+			// -- Truncated, or out of step with its keyframes
+			if (this->diverged < 0) this->diverged = this->tick;
+			return false;
+		}
+		this->keys = this->data[this->offset] & 0x0F;
+		this->run  = (this->data[this->offset++] >> 4) + 1;
+	}
+	this->run--;
+	*touchUp	= (this->keys & 1) != 0;
+	*touchDown	= (this->keys & 2) != 0;
+	*touchLeft	= (this->keys & 4) != 0;
+	*touchRight	= (this->keys & 8) != 0;
+	this->tick++;
+	return true;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// Ghosts: recorded runs raced against, drawn as translucent player cars from the poses of their
+// replay. A ghost file is streamed rather than loaded: a reader thread per ghost fills the two
+// halves of its buffer in turn while the game decodes the other one, so an hours long run costs as
+// much memory as a lap. Each tick decodes the few bytes up to the next pose and each frame
+// interpolates between the two poses around it.
+#define GHOST_BUFFER		16384			// bytes in each half
+#define GHOST_ALPHA			0x80
+
+class ghostCar {
+	public:
+		ghostCar();
+		bool open(const char * filename);
+		void close(void);
+		void advance(int tick);
+		bool pose(float time, float * z, float * x);
+		replayHeader header;
+		int  keys;							// of the last ticks decoded, for the steering sprite
+	private:
+		class sample {
+			public:
+				int   tick, position;
+				float x;
+		};
+		std::ifstream	file;
+		Uint8			buffer[2][GHOST_BUFFER];
+		int				length[2], half, offset;
+		SDL_sem		  * empty,
+					  * full;
+		SDL_Thread	  * thread;
+		bool			quit, finished;
+		int				streamTick, lastPosition;
+		Uint32			lastX;
+		sample			previous, next;
+		bool	getByte(Uint8 * byte);
+		Uint32	getVarint(void);
+		static int read(void * data);
+};
+
+ghostCar::ghostCar() {
+	this->empty		   = NULL;
+	this->full		   = NULL;
+	this->thread	   = NULL;
+	this->keys		   = 0;
+}
+
+bool ghostCar::open(const char * filename) {
+	this->file.open(filename, std::ios::in | std::ios::binary);
+	if (!this->file) {
+		std::cout << "Ghost " << filename << " could not be opened" << std::endl;
+		return false;
+	}
+	if ((!this->file.read((char *)&this->header, sizeof(this->header))) || (validReplay(filename, &this->header) == false))
+		return false;
+	this->header.track[sizeof(this->header.track) - 1] = '\0';
+	this->quit			= false;
+	this->finished		= false;
+	this->streamTick	= 0;
+	this->lastPosition	= 0;
+	this->lastX			= 0;
+	this->next.tick		= -1;
+	this->next.position	= 0;
+	this->next.x		= 0;
+	this->previous		= this->next;
+	this->empty			= SDL_CreateSemaphore(2);
+	this->full			= SDL_CreateSemaphore(0);
+	this->thread		= SDL_CreateThread(ghostCar::read, "ghost", this);
+	// -- The first half is waited for here, later ones are read ahead
+	SDL_SemWait(this->full);
+	this->half	 = 0;
+	this->offset = 0;
+	return true;
+}
+
+void ghostCar::close(void) {
+	if (this->thread != NULL) {
+		this->quit = true;
+		SDL_SemPost(this->empty);
+		SDL_WaitThread(this->thread, NULL);
+		SDL_DestroySemaphore(this->empty);
+		SDL_DestroySemaphore(this->full);
+		this->thread = NULL;
+	}
+	this->file.close();
+}
+
+// Fills the halves in turn as the game hands them back, an empty one marks the end of the file
+int ghostCar::read(void * data) {
+	ghostCar * ghost = (ghostCar *)data;
+	// --
+	for (int half = 0; ; half ^= 1) {
+		SDL_SemWait(ghost->empty);
+		if (ghost->quit == true)
+			break;
+		ghost->file.read((char *)ghost->buffer[half], GHOST_BUFFER);
+		ghost->length[half] = ghost->file.gcount();
+		SDL_SemPost(ghost->full);
+		if (ghost->length[half] == 0)
+			break;
+	}
+	return 0;
+}
+
+// Waits only when the disk fell a whole half behind
+bool ghostCar::getByte(Uint8 * byte) {
+	if (this->finished == true)
+		return false;
+	if (this->offset == this->length[this->half]) {
+		if (this->length[this->half] == 0) {
+			this->finished = true;
+			return false;
+		}
+		SDL_SemPost(this->empty);
+		this->half  ^= 1;
+		this->offset = 0;
+		SDL_SemWait(this->full);
+		return this->getByte(byte);
+	}
+	*byte = this->buffer[this->half][this->offset++];
+	return true;
+}
+
+Uint32 ghostCar::getVarint(void) {
+	Uint32 value = 0;
+	Uint8  byte;
+	// --
+	for (int shift = 0; (shift < 35) && (this->getByte(&byte) == true); shift += 7) {
+		value |= (Uint32)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+			break;
+	}
+	return value;
+}
+
+// Decodes up to the first pose at or after tick, so the poses around any time before it are known.
+// Keyframes are poses too, their speed and traffic skipped.
+void ghostCar::advance(int tick) {
+	Uint8  byte;
+	Uint32 zigzag;
+	// --
+	while ((this->next.tick < tick) && (this->getByte(&byte) == true)) {
+		if ((byte & REPLAY_KEYFRAME) == 0) {
+			this->keys		  = byte & 0x0F;
+			this->streamTick += (byte >> 4) + 1;
+			continue;
+		}
+		zigzag = this->getVarint();
+		this->lastPosition += (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+		if (byte == REPLAY_KEYFRAME)
+			this->getVarint();
+		this->lastX ^= this->getVarint();
+		if (byte == REPLAY_KEYFRAME)
+			for (Uint32 count = this->getVarint(); (count > 0) && (this->finished == false); count--) {
+				this->getVarint();
+				this->getVarint();
+			}
+		if (this->finished == true)
+			break;
+		this->previous		= this->next;
+		this->next.tick		= this->streamTick;
+		this->next.position	= this->lastPosition;
+		memcpy(&this->next.x, &this->lastX, sizeof(this->next.x));
+	}
+}
+
+// Where the car is at time (in ticks, fractional in between), z being its position on the road.
+// False before the first pose and after the last one.
+bool ghostCar::pose(float time, float * z, float * x) {
+	float percent = 1;
+	int	  distance;
+	// --
+	if ((this->next.tick < 0) || ((this->finished == true) && (time > this->next.tick)))
+		return false;
+	if ((this->previous.tick >= 0) && (time < this->next.tick))
+		percent = (time > this->previous.tick) ? (time - this->previous.tick) / (this->next.tick - this->previous.tick) : 0;
+	distance = this->next.position - this->previous.position;
+	if (distance < -trackLength / 2) distance += trackLength; // crossed the lap line
+	*z = this->previous.position + distance * percent + playerZ;
+	while (*z >= trackLength) *z -= trackLength;
+	*x = this->previous.x + (this->next.x - this->previous.x) * percent;
+	return true;
+}
+
+// The ghosts of a race, all of them recorded on the same track. Like trafficView, build() places
+// them for a frame; every camera finds their draw slots from there.
+class ghostRace {
+	public:
+		ghostRace();
+		bool add(const char * filename);
+		bool fits(const char * trackFile, Uint32 endlessSeed);
+		void clear(void);
+		void advance(void);
+		void build(float alpha);
+		SDL_Rect sprite(int ghost, float updown);
+		const replayHeader & header(int ghost);
+		int  size(void);
+		std::vector<float>	x, z;			// z is -1 for a ghost not on the road this frame
+		int  tick;							// ticks simulated since the race started
+	private:
+		std::vector<ghostCar *> cars;
+};
+
+ghostRace::ghostRace() {
+	this->tick = 0;
+}
+
+bool ghostRace::add(const char * filename) {
+	ghostCar * ghost = new ghostCar();
+	// --
+	if (ghost->open(filename) == false) {
+		ghost->close();
+		delete ghost;
+		return false;
+	}
+	if (ghost->header.endlessSeed != 0)
+		std::cout << "Ghost " << filename << " was recorded on an endless road, only fixed tracks can be raced again" << std::endl;
+	else if ((this->cars.size() > 0) && ((strcmp(ghost->header.track, this->cars[0]->header.track) != 0) || (ghost->header.tickLength != this->cars[0]->header.tickLength)))
+		std::cout << "Ghost " << filename << " was recorded on another track or tick rate than " << this->cars[0]->header.track << std::endl;
+	else {
+		this->cars.push_back(ghost);
+		return true;
+	}
+	ghost->close();
+	delete ghost;
+	return false;
+}
+
+// Whether the ghosts can race on a world built with trackFile or endlessSeed at the current tick length
+bool ghostRace::fits(const char * trackFile, Uint32 endlessSeed) {
+	if (this->cars.size() == 0)
+		return true;
+	if ((endlessSeed != 0) || (strcmp(this->cars[0]->header.track, (trackFile != NULL) ? trackFile : "") != 0) || (this->cars[0]->header.tickLength != dt)) {
+		std::cout << "Ghosts recorded on another track or tick rate" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void ghostRace::clear(void) {
+	for (int g = 0; g < this->cars.size(); g++) {
+		this->cars[g]->close();
+		delete this->cars[g];
+	}
+	this->cars.clear();
+	this->tick = 0;
+}
+
+void ghostRace::advance(void) {
+	this->tick++;
+	for (int g = 0; g < this->cars.size(); g++)
+		this->cars[g]->advance(this->tick);
+}
+
+// The frame drawn is alpha in between the last two ticks
+void ghostRace::build(float alpha) {
+	this->x.resize(this->cars.size());
+	this->z.resize(this->cars.size());
+	for (int g = 0; g < this->cars.size(); g++)
+		if (this->cars[g]->pose(this->tick - 1 + alpha, &this->z[g], &this->x[g]) == false)
+			this->z[g] = -1;
+}
+
+SDL_Rect ghostRace::sprite(int ghost, float updown) {
+	int keys = this->cars[ghost]->keys & 12;
+	// --
+	if (keys == 4)
+		return (updown > 0) ? PLAYER_UPHILL_LEFT_SPRITE : PLAYER_LEFT_SPRITE;
+	if (keys == 8)
+		return (updown > 0) ? PLAYER_UPHILL_RIGHT_SPRITE : PLAYER_RIGHT_SPRITE;
+	return (updown > 0) ? PLAYER_UPHILL_STRAIGHT_SPRITE : PLAYER_STRAIGHT_SPRITE;
+}
+
+const replayHeader & ghostRace::header(int ghost) {
+	return this->cars[ghost]->header;
+}
+
+int ghostRace::size(void) {
+	return this->cars.size();
+}
+
+ghostRace ghosts;
+
+// --------------------------------------------------------------------------------------
+
+#define max(a,b) ({ __typeof__ (a) _a = (a); __typeof__ (b) _b = (b); _a > _b ? _a : _b; })
+#define min(a,b) ({ __typeof__ (a) _a = (a); __typeof__ (b) _b = (b); _a < _b ? _a : _b; })
+
+// Draw list of the sprites, cars and player car of a frame, all cut from the sprites.png atlas.
+// Each one is projected once into a compact entry; the ones fully off screen, fully hidden behind
+// a hill or shrunk to a dot (both sides under SPRITE_LOD_PIXELS) are dropped. flush() orders them
+// far to near (stable, so equal depths keep the segment walk order) and submits them in one
+// SDL_RenderGeometry call, or one SDL_RenderCopy(Ex) each when not batched or with SDL older than
+// 2.0.18. With the CPU rasterizer enabled they are blitted by it.
+#define SPRITE_LOD_PIXELS	2
+
+class spriteBatch {
+	public:
+		spriteBatch();
+		void begin(SDL_Renderer* renderer, SDL_Texture* atlas, int width, int height);
+		void add(SDL_Rect spriteRect, SDL_Rect dstRect, float depth, bool flip, Uint8 alpha = 0xFF);
+		void prepare(void);
+		void flush(void);
+		bool batched;
+		int  drawn, culled;
+	private:
+		class entry {
+			public:
+				SDL_Rect spriteRect, dstRect;
+				float	 depth;
+				bool	 flip;
+				Uint8	 alpha;
+				bool operator < (const entry & other) const { return this->depth < other.depth; }
+		};
+		SDL_Renderer * renderer;
+		SDL_Texture  * atlas;
+		int width, height, atlasWidth, atlasHeight;
+		bool prepared;
+		std::vector<entry> entries;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+		std::vector<SDL_Vertex> vertices;
+		std::vector<int> 		indices;
+#endif
+};
+
+spriteBatch::spriteBatch() {
+	this->renderer	  = NULL;
+	this->atlas		  = NULL;
+	this->width		  = 0;
+	this->height	  = 0;
+	this->atlasWidth  = 1;
+	this->atlasHeight = 1;
+	this->drawn		  = 0;
+	this->culled	  = 0;
+	this->prepared	  = false;
+	this->batched	  = SDL_VERSION_ATLEAST(2, 0, 18);
+}
+
+void spriteBatch::begin(SDL_Renderer* renderer, SDL_Texture* atlas, int width, int height) {
+	this->renderer	= renderer;
+	this->width		= width;
+	this->height	= height;
+	this->drawn		= 0;
+	this->culled	= 0;
+	this->prepared	= false;
+	this->entries.clear();
+	if ((atlas != this->atlas) && (atlas != NULL)) {
+		this->atlas = atlas;
+		SDL_QueryTexture(atlas, NULL, NULL, &this->atlasWidth, &this->atlasHeight);
+	}
+#if !SDL_VERSION_ATLEAST(2, 0, 18)
+	this->batched	= false;
+#endif
+}
+
+// depth grows towards the camera (sprite scale), dstRect already clipped by the road in front.
+// alpha below 0xFF draws the sprite translucent.
+void spriteBatch::add(SDL_Rect spriteRect, SDL_Rect dstRect, float depth, bool flip, Uint8 alpha) {
+	entry sprite;
+	// --
+	if ((dstRect.w <= 0) || (dstRect.h <= 0) || (spriteRect.h <= 0) ||
+		((dstRect.w < SPRITE_LOD_PIXELS) && (dstRect.h < SPRITE_LOD_PIXELS)) ||
+		(dstRect.x + dstRect.w <= 0) || (dstRect.x >= this->width) ||
+		(dstRect.y + dstRect.h <= 0) || (dstRect.y >= this->height)) {
+		this->culled++;
+		return;
+	}
+	sprite.spriteRect = spriteRect;
+	sprite.dstRect	  = dstRect;
+	sprite.depth	  = depth;
+	sprite.flip		  = flip;
+	sprite.alpha	  = alpha;
+	this->entries.push_back(sprite);
+}
+
+// Orders the sprites and, batched, lays out their vertices: all the work that needs no renderer, so
+// it may run on any thread. flush() does it when it was not done.
+void spriteBatch::prepare(void) {
+	std::stable_sort(this->entries.begin(), this->entries.end());
+	this->drawn	   = this->entries.size();
+	this->prepared = true;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	SDL_Vertex vertex;
+	float	   u1, u2, v1, v2;
+	// --
+	this->vertices.clear();
+	this->indices.clear();
+	if ((rasterizer.enabled == true) || (this->batched == false))
+		return;
+	vertex.color.r = vertex.color.g = vertex.color.b = 0xFF;
+	for (int i = 0; i < this->entries.size(); i++) {
+		const entry & sprite = this->entries[i];
+		int base = this->vertices.size();
+		vertex.color.a = sprite.alpha;
+		u1 = (float)sprite.spriteRect.x / this->atlasWidth;
+		u2 = (float)(sprite.spriteRect.x + sprite.spriteRect.w) / this->atlasWidth;
+		v1 = (float)sprite.spriteRect.y / this->atlasHeight;
+		v2 = (float)(sprite.spriteRect.y + sprite.spriteRect.h) / this->atlasHeight;
+		if (sprite.flip == true) {
+			float u = u1; u1 = u2; u2 = u;
+		}
+		vertex.position.x = sprite.dstRect.x;					vertex.position.y = sprite.dstRect.y;
+		vertex.tex_coord.x = u1;								vertex.tex_coord.y = v1;				this->vertices.push_back(vertex);
+		vertex.position.x = sprite.dstRect.x + sprite.dstRect.w;
+		vertex.tex_coord.x = u2;																		this->vertices.push_back(vertex);
+		vertex.position.y = sprite.dstRect.y + sprite.dstRect.h;
+		vertex.tex_coord.y = v2;																		this->vertices.push_back(vertex);
+		vertex.position.x = sprite.dstRect.x;
+		vertex.tex_coord.x = u1;																		this->vertices.push_back(vertex);
+		this->indices.push_back(base);		this->indices.push_back(base + 1);	this->indices.push_back(base + 2);
+		this->indices.push_back(base);		this->indices.push_back(base + 2);	this->indices.push_back(base + 3);
+	}
+#endif
+}
+
+void spriteBatch::flush(void) {
+	if (this->prepared == false)
+		this->prepare();
+	this->prepared = false;
+	if (rasterizer.enabled == true) {
+		for (int i = 0; i < this->entries.size(); i++)
+			rasterizer.blit(RASTER_SPRITES, this->entries[i].spriteRect, this->entries[i].dstRect, this->entries[i].flip, this->entries[i].alpha);
+		return;
+	}
+	if (this->batched == false) {
+		for (int i = 0; i < this->entries.size(); i++) {
+			if (this->entries[i].alpha != 0xFF)
+				SDL_SetTextureAlphaMod(this->atlas, this->entries[i].alpha);
+			if (this->entries[i].flip == true)
+				SDL_RenderCopyEx(this->renderer, this->atlas, &this->entries[i].spriteRect, &this->entries[i].dstRect, 0, NULL, SDL_FLIP_HORIZONTAL);
+			else
+				SDL_RenderCopy(this->renderer, this->atlas, &this->entries[i].spriteRect, &this->entries[i].dstRect);
+			if (this->entries[i].alpha != 0xFF)
+				SDL_SetTextureAlphaMod(this->atlas, 0xFF);
+		}
+		profiler.drawCalls += this->entries.size();
+		return;
+	}
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	if (this->vertices.size() > 0) {
+		SDL_RenderGeometry(this->renderer, this->atlas, &this->vertices[0], this->vertices.size(), &this->indices[0], this->indices.size());
+		profiler.drawCalls++;
+	}
+#endif
+}
+
+
+void renderSprite(spriteBatch & sprites, int width, int height, float resolution, int roadWidth, SDL_Rect spriteRect, float spriteScale, float X, float Y, float offsetX, float offsetY, int clipY, bool flip, Uint8 alpha = 0xFF) {
+	SDL_Rect dstrect;
+	dstrect.w	= (spriteRect.w * spriteScale * width / 2.0) * (scaleSprites * roadWidth);
+	dstrect.h	= (spriteRect.h * spriteScale * width / 2.0) * (scaleSprites * roadWidth);
+	dstrect.x	= X + dstrect.w * offsetX;
+	dstrect.y 	= Y + dstrect.h * offsetY;	 
+    float clipH = (clipY != 0) ? max(0, dstrect.y + dstrect.h - clipY) : 0;
+	// --
+	if (clipH < dstrect.h) {
+		spriteRect.h -= (spriteRect.h * clipH / dstrect.h);
+		dstrect.h -= clipH;
+		sprites.add(spriteRect, dstrect, spriteScale, flip, alpha);
+	} else
+		sprites.culled++;
+}
+
+// shake is the random part of the bounce, drawn by the caller so views built on other threads
+// leave effectsRandom alone
+void renderPlayer(spriteBatch & sprites, int width, int height, float resolution, int roadWidth, float speedPercent, float spriteScale, float X, float Y, float steer, float updown, bool offroad, float shake) {
+	SDL_Rect spriteRect;	
+	float bounce = 1.5 * shake * speedPercent * resolution;
+	
+	if (offroad) bounce *= 5;
+	
+	if (steer < 0)
+     	spriteRect = (updown > 0) ? PLAYER_UPHILL_LEFT_SPRITE : PLAYER_LEFT_SPRITE;
+    else if (steer > 0)
+      	spriteRect = (updown > 0) ? PLAYER_UPHILL_RIGHT_SPRITE : PLAYER_RIGHT_SPRITE;
+    else
+      	spriteRect = (updown > 0) ? PLAYER_UPHILL_STRAIGHT_SPRITE : PLAYER_STRAIGHT_SPRITE;
+
+    renderSprite(	sprites, 
+					width, 
+					height, 
+					resolution, 
+					roadWidth, 
+					spriteRect,
+					spriteScale,
+					X, 
+					Y + bounce, 
+					-0.5, 
+					-1.0,
+					0,
+					false
+				);	
+}
+ 
+void renderBackground(SDL_Renderer* renderer, SDL_Texture * backgrounds, int width, int height, SDL_Rect spriteRect, float rotation, float y_offset)  {
+    SDL_Rect srcrect;
+    srcrect.x = spriteRect.x + (spriteRect.w * rotation);
+    srcrect.y = spriteRect.y;
+    srcrect.w = spriteRect.w + spriteRect.x - srcrect.x;//min(spriteRect.w / 2, spriteRect.w - (spriteRect.w * rotation));
+    srcrect.h = spriteRect.h;
+    
+    SDL_Rect dstrect;
+	dstrect.x = 0;
+    dstrect.y = y_offset;
+    dstrect.w = srcrect.w * ((float)width/(float)spriteRect.w) + 1;//width * (srcrect.w / (spriteRect.w / 2));
+    dstrect.h = height;
+
+	if (rasterizer.enabled == true)
+		rasterizer.blit(RASTER_BACKGROUNDS, srcrect, dstrect, false);
+	else {
+		SDL_RenderCopy(renderer, backgrounds, &srcrect, &dstrect);
+		profiler.drawCalls++;
+	}
+
+ 	srcrect.x = spriteRect.x;
+   	srcrect.w = spriteRect.w;//(spriteRect.w / 2) - srcrect.w;
+   	dstrect.x = dstrect.w - 1;
+   	dstrect.w = spriteRect.w * ((float)width/(float)spriteRect.w) + 1;//width - (width * (srcrect.w / (spriteRect.w / 2)));
+
+	if (rasterizer.enabled == true)
+		rasterizer.blit(RASTER_BACKGROUNDS, srcrect, dstrect, false);
+	else {
+		SDL_RenderCopy(renderer, backgrounds, &srcrect, &dstrect);
+		profiler.drawCalls++;
+	}
+}
+
+// Where the cars are drawn: in between their last two ticks. The interpolated position may fall a
+// segment behind the one the car is linked to in traffic.
+class trafficView {
+	public:
+		void build(float alpha);
+		std::vector<float> x, z;
+};
+
+void trafficView::build(float alpha) {
+	int dz;
+	// --
+	this->x.resize(traffic.size());
+	this->z.resize(traffic.size());
+	for (int n = 0; n < traffic.size(); n++) {
+		dz = traffic.cars[n].z_offset - traffic.prevZ[n];
+		if (dz < 0) dz += trackLength;
+		this->z[n] = traffic.prevZ[n] + dz * alpha;
+		if (this->z[n] >= trackLength) this->z[n] -= trackLength;
+		this->x[n] = traffic.prevX[n] + (traffic.cars[n].x_offset - traffic.prevX[n]) * alpha;
+	}
+}
+
+trafficView carView;
+
+// Cars (or ghosts) bucketed by the draw slot of one camera, count segments from baseIndex on.
+// Every slot lists them in array order; a negative z is never drawn.
+class slotList {
+	public:
+		void build(const std::vector<float> & z, int baseIndex, int count);
+		int  first(int slot);
+		int  next(int n);
+	private:
+		std::vector<int> head, nextItem;
+};
+
+void slotList::build(const std::vector<float> & z, int baseIndex, int count) {
+	int slot;
+	// --
+	this->head.assign(count, -1);
+	this->nextItem.resize(z.size());
+	// Backwards so every slot lists its cars in array order
+	for (int n = z.size() - 1; n >= 0; n--) {
+		if (z[n] < 0)
+			continue;
+		slot = ((int)z[n] / segmentLength - baseIndex + segments.size()) % segments.size();
+		if (slot < count) {
+			this->nextItem[n] = this->head[slot];
+			this->head[slot]  = n;
+		}
+	}
+}
+
+int slotList::first(int slot) {
+	return this->head[slot];
+}
+
+int slotList::next(int n) {
+	return this->nextItem[n];
+}
+
+// One segment: grass, rumbles, road and lanes. LANES is the lane count when known at compile time
+// (0 takes numLanes instead) and FOG false when the fog is off, so the instantiations picked by
+// renderRoad have the lane loop unrolled, the rumble and lane widths folded into constants and no
+// fog lookups. The far edge is the one of slot last, further than slot for a merged run.
+template <int LANES, bool FOG>
+inline void renderSegment(roadBatch & road, int width, int numLanes, const Segment & segment, const roadProjection & projection, const fogTable & fog, int slot, int last) {
+	const int lanes = (LANES > 0) ? LANES : numLanes;
+	float 	x1 = projection.p1screenX[slot],
+			y1 = projection.p1screenY[slot],
+			w1 = projection.p1screenW[slot],
+			x2 = projection.p2screenX[last],
+			y2 = projection.p2screenY[last],
+			w2 = projection.p2screenW[last];	
+	
+	float 	r1 = w1 / max(6 , 2 * lanes),
+			r2 = w2 / max(6 , 2 * lanes),
+			l1 = w1 / max(32, 8 * lanes),
+			l2 = w2 / max(32, 8 * lanes);
+
+	int points[4][2];
+	
+	points[0][0] = 0;  			points[0][1] = y2;
+	points[1][0] = width-1; 	points[1][1] = y2;
+	points[2][0] = width-1;		points[2][1] = y1;
+	points[3][0] = 0;  			points[3][1] = y1;
+	
+	road.addTrapezium(points, FOG ? fog.apply(segment.colorGrass, slot) : segment.colorGrass);
+		
+	SDL_Color colorRumble = FOG ? fog.apply(segment.colorRumble, slot) : segment.colorRumble;
+
+	points[0][0] = x2-w2-r2;	points[0][1] = y2;
+	points[1][0] = x2-w2;		points[1][1] = y2;
+	points[2][0] = x1-w1;	 	points[2][1] = y1;
+	points[3][0] = x1-w1-r1;	points[3][1] = y1;
 	
-	if (segment.fog < 1) {
-		SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND); // To allow alpha blending
-		SDL_SetRenderDrawColor(renderer, FOG_COLOR.r, FOG_COLOR.g, FOG_COLOR.b, 255 - segment.fog*255);
-		SDL_RenderFillRect(renderer, & rect);
-	}
-}
-
-void render(SDL_Renderer* renderer, int position, SDL_Texture * spriteSheet, float speed, bool touchLeft, bool touchRight, SDL_Texture * backgrounds, float skyOffset, float hillOffset, float treeOffset) {
-	Segment baseSegment   = findSegment(position),
-			playerSegment = findSegment(position + playerZ),
-			segment;
-	float 	basePercent   = (float)(position%segmentLength)/(float)segmentLength,
-			playerPercent = (float)( (int)  (position+playerZ)%segmentLength)/(float)segmentLength;
-	float 	playerY       = playerSegment.p1worldY + (playerSegment.p2worldY - playerSegment.p1worldY) * playerPercent;
-	int		maxy          = SCREEN_HEIGHT;
-	int 	x  			  = 0;
-	float 	dx 			  = - (baseSegment.curve * basePercent);
-	int 	leftRight	  = 0;
+	road.addTrapezium(points, colorRumble);
 	
-	renderBackground(renderer, backgrounds, SCREEN_WIDTH, SCREEN_HEIGHT, BACKGROUND_SKY,   skyOffset,  resolution * skySpeed  * playerY);
-    renderBackground(renderer, backgrounds, SCREEN_WIDTH, SCREEN_HEIGHT, BACKGROUND_HILLS, hillOffset, resolution * hillSpeed * playerY);
-    renderBackground(renderer, backgrounds, SCREEN_WIDTH, SCREEN_HEIGHT, BACKGROUND_TREES, treeOffset, resolution * treeSpeed * playerY);
+	points[0][0] = x2+w2+r2;	points[0][1] = y2;
+	points[1][0] = x2+w2;		points[1][1] = y2;
+	points[2][0] = x1+w1;	 	points[2][1] = y1;
+	points[3][0] = x1+w1+r1;	points[3][1] = y1;
 	
-	// Render road
-	for (int i = 0; i < drawDistance; i++) {
-		segment        = segments[(baseSegment.index + i) % segments.size()];
-		segment.looped = ((segment.index < baseSegment.index)? true : false);
-		//segment.fog    = 1.0/pow(__E, (float)(i)/(float)(drawDistance) * (float)(i)/(float)(drawDistance) * fogDensity);
-		segment.fog    = 1.0/pow((float)__E, (float)(i)/(float)(drawDistance) * (float)(i)/(float)(drawDistance) * (float)fogDensity);
-		segment.clip   = maxy;
+	road.addTrapezium(points, colorRumble);
 	
-		// Project
-    	segment.p1cameraX = segment.p1worldX - ((playerX * roadWidth) - x);
-		segment.p1cameraY = segment.p1worldY - (playerY + cameraHeight); 
-		segment.p1cameraZ = segment.p1worldZ - (position - (segment.looped ? trackLength : 0));
-		segment.p1screenX = round((SCREEN_WIDTH/2)  + ((cameraDepth/segment.p1cameraZ) * segment.p1cameraX  * SCREEN_WIDTH/2));
-		segment.p1screenY = round((SCREEN_HEIGHT/2) - ((cameraDepth/segment.p1cameraZ) * segment.p1cameraY  * SCREEN_HEIGHT/2));
-		segment.p1screenW = round((((cameraDepth/segment.p1cameraZ))* roadWidth * SCREEN_WIDTH/2));		
-
-		segment.p2cameraX = segment.p2worldX - ((playerX * roadWidth) - x - dx);
-		segment.p2cameraY = segment.p2worldY - (playerY + cameraHeight);
-		segment.p2cameraZ = segment.p2worldZ - (position - (segment.looped ? trackLength : 0));
-		segment.p2screenX = round((SCREEN_WIDTH/2)  + ((cameraDepth/segment.p2cameraZ) * segment.p2cameraX  * SCREEN_WIDTH/2));
-		segment.p2screenY = round((SCREEN_HEIGHT/2) - ((cameraDepth/segment.p2cameraZ) * segment.p2cameraY  * SCREEN_HEIGHT/2));
-		segment.p2screenW = round((((cameraDepth/segment.p2cameraZ))* roadWidth * SCREEN_WIDTH/2));		
-
-		segments[(baseSegment.index + i) % segments.size()]	= segment;
+	points[0][0] = x2-w2;		points[0][1] = y2;
+	points[1][0] = x2+w2;		points[1][1] = y2;
+	points[2][0] = x1+w1;	 	points[2][1] = y1;
+	points[3][0] = x1-w1;		points[3][1] = y1;
+	
+	road.addTrapezium(points, FOG ? fog.apply(segment.colorRoad, slot) : segment.colorRoad);
 	
-		x  = x + dx;
-		dx = dx + segment.curve;
+	float 	lane_w1 = w1 * 2 / lanes,
+			lane_w2 = w2 * 2 / lanes,
+			lane_x1 = x1 - w1 + lane_w1,
+			lane_x2 = x2 - w2 + lane_w2;
+
+	if (segment.colorLane.a == 0xFF) {
+		SDL_Color colorLane = FOG ? fog.apply(segment.colorLane, slot) : segment.colorLane;
+		for (int lane = 1; lane < lanes; lane_x1 += lane_w1, lane_x2 += lane_w2, lane++) {
+			points[0][0] = (lane_x2 - l2 / 2);	points[0][1] = y2;
+			points[1][0] = (lane_x2 + l2 / 2);	points[1][1] = y2;
+			points[2][0] = (lane_x1 + l1 / 2);	points[2][1] = y1;
+			points[3][0] = (lane_x1 - l1 / 2);	points[3][1] = y1;
+
+			road.addTrapezium(points, colorLane);
+		}
+	}
+}
+
+// Far segments under ROAD_LOD_ROWS rows tall are merged with the ones behind them, as long as the
+// run stays under that height and keeps climbing the screen, and drawn as one segment
+#define ROAD_LOD_ROWS	2
 
-		if ((segment.p1cameraZ <= cameraDepth)       || // behind us
-			(segment.p2screenY >= segment.p1screenY) || // back face cull
-			(segment.p2screenY >= maxy))                // clip by (already rendered) hill
+// Colors of the segments in slots first to last blended into one, fog included, so the rumble and
+// lane stripes of a merged run average out instead of each row taking the color of whichever
+// segment happens to land on it. Lanes are drawn when any segment of the run has them.
+Segment blendSegments(int baseIndex, int first, int last, const fogTable & fog, bool fogged) {
+	Segment	blend = segments[(baseIndex + first) % segments.size()];
+	int		sum[4][3] = { { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 } },
+			n		  = last - first + 1,
+			lanes	  = 0;
+	SDL_Color * colors[4] = { &blend.colorGrass, &blend.colorRumble, &blend.colorRoad, &blend.colorLane };
+	// --
+	for (int i = first; i <= last; i++) {
+		const Segment & segment = segments[(baseIndex + i) % segments.size()];
+		SDL_Color color[4] = { segment.colorGrass, segment.colorRumble, segment.colorRoad, (segment.colorLane.a == 0xFF) ? segment.colorLane : segment.colorRoad };
+		// --
+		if (segment.colorLane.a == 0xFF) lanes++;
+		for (int c = 0; c < 4; c++) {
+			if (fogged == true) color[c] = fog.apply(color[c], i);
+			sum[c][0] += color[c].r;	sum[c][1] += color[c].g;	sum[c][2] += color[c].b;
+		}
+	}
+	for (int c = 0; c < 4; c++) {
+		colors[c]->r = sum[c][0] / n;	colors[c]->g = sum[c][1] / n;	colors[c]->b = sum[c][2] / n;
+		colors[c]->a = 0xFF;
+	}
+	if (lanes == 0) blend.colorLane.a = 0;
+	return blend;
+}
+
+// Road of a frame, nearest segment first; each segment is clipped by the hills already drawn
+// (maxy) and leaves that clip in projection.clip for the sprites behind it
+template <int LANES, bool FOG>
+void renderRoad(roadBatch & road, int width, int height, int numLanes, int baseIndex, roadProjection & projection, const fogTable & fog, int count) {
+	int maxy = height,
+		last;
+	// --
+	for (int i = 0; i < count; i++) {
+		projection.clip[i] = maxy;
+
+		if ((projection.p1cameraZ[i] <= cameraDepth)               || // behind us
+			(projection.p2screenY[i] >= projection.p1screenY[i]) || // back face cull
+			(projection.p2screenY[i] >= maxy))                      // clip by (already rendered) hill
 			continue;
 		
-		renderSegment(renderer, SCREEN_WIDTH, numLanes, segment);
+		// Level of detail: a thin far segment takes the thin ones behind it, their sprites are clipped
+		// by the near edge of the merged segment as everything behind segment i would be
+		last = i;
+		while ((last + 1 < count) && (projection.p1screenY[i] - projection.p2screenY[last + 1] < ROAD_LOD_ROWS) &&
+			   (projection.p2screenY[last + 1] <= projection.p2screenY[last]))
+			projection.clip[++last] = projection.p1screenY[i];
+		if (last == i)
+			renderSegment<LANES, FOG>(road, width, numLanes, segments[(baseIndex + i) % segments.size()], projection, fog, i, i);
+		else
+			renderSegment<LANES, false>(road, width, numLanes, blendSegments(baseIndex, i, last, fog, FOG), projection, fog, i, last);
 		
-		maxy = segment.p1screenY;
+		maxy = projection.p1screenY[last];
+		i	 = last;
+	}
+}
+
+// Picks the instantiation once per frame: 2, 3 and 4 lanes have their own, any other count goes
+// through the generic one
+void renderRoad(roadBatch & road, int width, int height, int numLanes, int baseIndex, roadProjection & projection, const fogTable & fog, int count, bool fogged) {
+	switch ((fogged ? 8 : 0) + ((numLanes >= 2) && (numLanes <= 4) ? numLanes : 0)) {
+		case 2:		renderRoad<2, false>(road, width, height, numLanes, baseIndex, projection, fog, count);	break;
+		case 3:		renderRoad<3, false>(road, width, height, numLanes, baseIndex, projection, fog, count);	break;
+		case 4:		renderRoad<4, false>(road, width, height, numLanes, baseIndex, projection, fog, count);	break;
+		case 8 + 2:	renderRoad<2, true>(road, width, height, numLanes, baseIndex, projection, fog, count);	break;
+		case 8 + 3:	renderRoad<3, true>(road, width, height, numLanes, baseIndex, projection, fog, count);	break;
+		case 8 + 4:	renderRoad<4, true>(road, width, height, numLanes, baseIndex, projection, fog, count);	break;
+		case 8:		renderRoad<0, true>(road, width, height, numLanes, baseIndex, projection, fog, count);	break;
+		default:	renderRoad<0, false>(road, width, height, numLanes, baseIndex, projection, fog, count);	break;
 	}
+}
 
-	// Render Sprites and Cars
+#define MAX_VIEWS 4
+
+// Height of the road under the player car seen from position
+float roadHeight(int position) {
+	const Segment & playerSegment = findSegment(position + playerZ);
+	float percent = (float)((int)(position + playerZ) % segmentLength) / (float)segmentLength;
+	// --
+	return playerSegment.p1worldY + (playerSegment.p2worldY - playerSegment.p1worldY) * percent;
+}
+
+// One camera on the shared simulation: the car it follows, the part of the window it is drawn in
+// and its own projection and draw lists, so the cameras of a split screen build side by side.
+// position and playerX come interpolated between the last two ticks; steer is -1, 0 or 1.
+class cameraView {
+	public:
+		cameraView();
+		void setViewport(int x, int y, int width, int height);
+		void drawBackgrounds(SDL_Renderer * renderer, SDL_Texture * backgrounds);
+		void build(SDL_Renderer * renderer, SDL_Texture * spriteSheet, int lane);
+		void flush(void);
+		int 			position, speed, steer;
+		float			playerX, shake, skyOffset, hillOffset, treeOffset, resolution;
+		SDL_Rect		viewport;
+		roadProjection	projection;
+		roadBatch		road;
+		spriteBatch		sprites;
+	private:
+		slotList		cars, ghostCars;
+};
+
+cameraView::cameraView() {
+	this->position	 = this->speed = this->steer = 0;
+	this->playerX	 = this->shake = 0;
+	this->skyOffset	 = this->hillOffset = this->treeOffset = 0;
+	this->setViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+}
+
+void cameraView::setViewport(int x, int y, int width, int height) {
+	this->viewport.x = x;		this->viewport.w = width;
+	this->viewport.y = y;		this->viewport.h = height;
+	this->resolution = height / 480.0;
+}
+
+void cameraView::drawBackgrounds(SDL_Renderer * renderer, SDL_Texture * backgrounds) {
+	float playerY = roadHeight(this->position);
+	phaseTimer timer(PHASE_BACKGROUNDS);
+	// --
+	renderBackground(renderer, backgrounds, this->viewport.w, this->viewport.h, BACKGROUND_SKY,   this->skyOffset,  this->resolution * skySpeed  * playerY);
+	renderBackground(renderer, backgrounds, this->viewport.w, this->viewport.h, BACKGROUND_HILLS, this->hillOffset, this->resolution * hillSpeed * playerY);
+	renderBackground(renderer, backgrounds, this->viewport.w, this->viewport.h, BACKGROUND_TREES, this->treeOffset, this->resolution * treeSpeed * playerY);
+}
+
+// Projects the road and fills the draw lists, touching the renderer only when the road or the
+// sprites are not batched. Timed on the trace lane given.
+void cameraView::build(SDL_Renderer * renderer, SDL_Texture * spriteSheet, int lane) {
+	Segment & baseSegment   = findSegment(this->position),
+			& playerSegment = findSegment(this->position + playerZ);
+	float 	basePercent = (float)(this->position % segmentLength) / (float)segmentLength;
+	int		width		= this->viewport.w,
+			height		= this->viewport.h;
+	phaseTimer timer(PHASE_PROJECTION, lane);
+	// --
+	this->projection.project(this->position, baseSegment.index, basePercent, this->playerX, roadHeight(this->position), drawDistance, width, height);
+	timer.next(PHASE_SEGMENTS);
+	this->road.begin(renderer, width, height);
+	renderRoad(this->road, width, height, numLanes, baseSegment.index, this->projection, roadFog, drawDistance, fogDensity > 0);
+
+	// Sprites and cars
+	timer.next(PHASE_SPRITES);
+	this->cars.build(carView.z, baseSegment.index, drawDistance);
+	this->ghostCars.build(ghosts.z, baseSegment.index, drawDistance);
+	this->sprites.begin(renderer, spriteSheet, width, height);
 	for (int i = (drawDistance-1); i > 0; i--) {
-        segment        = segments[(baseSegment.index + i) % segments.size()];
-	    // Render Cars
-		for (int j = 0; j < segment.cars.size(); j++) 
-			renderSprite(	renderer, 
-							SCREEN_WIDTH, 
-							SCREEN_HEIGHT, 
-							resolution, 
+		const Segment & segment = segments[(baseSegment.index + i) % segments.size()];
+		float scale1 = (float)cameraDepth/(float)this->projection.p1cameraZ[i],
+			  scale2 = (float)cameraDepth/(float)this->projection.p2cameraZ[i];
+		// Cars
+		for (int n = this->cars.first(i); n != -1; n = this->cars.next(n)) {
+			float percent = (float) fmodf(carView.z[n], segmentLength)/(float)segmentLength,
+				  scale	  = scale1 + (scale2 - scale1) * percent;
+			renderSprite(	this->sprites, 
+							width, 
+							height, 
+							this->resolution, 
 							roadWidth, 
-							spriteSheet, 
-							segment.cars[j].spriteRect, 
-							(float)cameraDepth/(float)segment.p1cameraZ + ( (float)cameraDepth/(float)segment.p2cameraZ - (float)cameraDepth/(float)segment.p1cameraZ ) * ((float) (segment.cars[j].z_offset%segmentLength)/(float)segmentLength),
-							(segment.p1screenX + (segment.p2screenX - segment.p1screenX) * ((float) (segment.cars[j].z_offset%segmentLength)/(float)segmentLength)) + (((float)cameraDepth/(float)segment.p1cameraZ + ( (float)cameraDepth/(float)segment.p2cameraZ - (float)cameraDepth/(float)segment.p1cameraZ ) * ((float) (segment.cars[j].z_offset%segmentLength)/(float)segmentLength)) * segment.cars[j].x_offset * roadWidth * SCREEN_WIDTH/2),
-							segment.p1screenY + ((segment.p2screenY - segment.p1screenY)) * ((float) (segment.cars[j].z_offset%segmentLength)/(float)segmentLength),
+							traffic.cars[n].spriteRect, 
+							scale,
+							(this->projection.p1screenX[i] + (this->projection.p2screenX[i] - this->projection.p1screenX[i]) * percent) + (scale * carView.x[n] * roadWidth * width/2),
+							this->projection.p1screenY[i] + ((this->projection.p2screenY[i] - this->projection.p1screenY[i])) * percent,
 							-0.5, 
 							-1, 
-							segment.clip,
-							(segment.cars[j].x_offset < playerX ? false : true)
+							this->projection.clip[i],
+							(carView.x[n] < this->playerX ? false : true)
 						);
-        // Render Sprites
-    	for (int j = 0; j < segment.sprites.size(); j++)
-  			renderSprite(	renderer, 
-			  				SCREEN_WIDTH, 
-							SCREEN_HEIGHT, 
-							resolution, 
+		}
+		// Ghosts, placed like cars
+		for (int g = this->ghostCars.first(i); g != -1; g = this->ghostCars.next(g)) {
+			float percent = (float) fmodf(ghosts.z[g], segmentLength)/(float)segmentLength,
+				  scale	  = scale1 + (scale2 - scale1) * percent;
+			renderSprite(	this->sprites, 
+							width, 
+							height, 
+							this->resolution, 
+							roadWidth, 
+							ghosts.sprite(g, segment.p2worldY - segment.p1worldY), 
+							scale,
+							(this->projection.p1screenX[i] + (this->projection.p2screenX[i] - this->projection.p1screenX[i]) * percent) + (scale * ghosts.x[g] * roadWidth * width/2),
+							this->projection.p1screenY[i] + ((this->projection.p2screenY[i] - this->projection.p1screenY[i])) * percent,
+							-0.5, 
+							-1, 
+							this->projection.clip[i],
+							false,
+							GHOST_ALPHA
+						);
+		}
+		// Roadside sprites, skipped all at once when even the largest one would be a dot or hidden
+		// behind the hill in front
+		float largest	 = scale1 * roadside.largest * ((float)width / 2.0) * scaleSprites * roadWidth;
+		int	  lastSprite = roadside.first(segment.index + 1);
+		if ((largest < SPRITE_LOD_PIXELS) || ((this->projection.clip[i] != 0) && (this->projection.p1screenY[i] - largest >= this->projection.clip[i])))
+			lastSprite = roadside.first(segment.index);
+		for (int j = roadside.first(segment.index); j < lastSprite; j++)
+			renderSprite(	this->sprites, 
+							width, 
+							height, 
+							this->resolution, 
 							roadWidth, 
-							spriteSheet, 
-							segment.sprites[j].spriteRect, 
-							(float)cameraDepth/(float)segment.p1cameraZ, 
-							segment.p1screenX + (((float)cameraDepth/(float)segment.p1cameraZ) * (segment.sprites[j].x_offset) * ((float)roadWidth) * ((float)SCREEN_WIDTH / 2.0)), 
-							segment.p1screenY, 
-							(segment.sprites[j].x_offset < 0 ? -1 : 0), 
+							roadside.sprites[j].spriteRect, 
+							scale1, 
+							this->projection.p1screenX[i] + (scale1 * (roadside.sprites[j].x_offset) * ((float)roadWidth) * ((float)width / 2.0)), 
+							this->projection.p1screenY[i], 
+							(roadside.sprites[j].x_offset < 0 ? -1 : 0), 
 							-1, 
-							segment.clip,
+							this->projection.clip[i],
 							false
 						);
-        // Render PlayerCar
-        if (touchLeft  == true) leftRight -= 1;
-        if (touchRight == true) leftRight += 1;
-        if (segment.index == playerSegment.index)
-          	renderPlayer(	renderer, 
-			  				SCREEN_WIDTH, 
-							SCREEN_HEIGHT, 
-							resolution, 
+		// The car this camera follows
+		if (segment.index == playerSegment.index)
+			renderPlayer(	this->sprites, 
+							width, 
+							height, 
+							this->resolution, 
 							roadWidth, 
-							spriteSheet, 
-							(float)speed / (float)maxSpeed,
+							(float)this->speed / (float)maxSpeed,
 							(float)cameraDepth / (float)playerZ,
-                        	SCREEN_WIDTH / 2.0,
-							SCREEN_HEIGHT,
-							//(SCREEN_HEIGHT / 2.0) - (((float)cameraDepth/(float)playerZ) * (playerSegment.p1cameraY + (playerSegment.p2cameraY - playerSegment.p1cameraY) * playerPercent) * SCREEN_HEIGHT / 2.0),
-	                       	speed * leftRight,
+							width / 2.0,
+							height,
+							this->speed * this->steer,
 							playerSegment.p2worldY - playerSegment.p1worldY,
-							((playerX < -1) || (playerX > 1))
+							((this->playerX < -1) || (this->playerX > 1)),
+							this->shake
 						);
-   	}
+	}
+	this->sprites.prepare();
+}
+
+// Submits what build() left, road first
+void cameraView::flush(void) {
+	phaseTimer timer(PHASE_SEGMENTS);
+	// --
+	this->road.flush();
+	timer.next(PHASE_SPRITES);
+	this->sprites.flush();
+}
+
+// Builds the cameras of a frame at once, camera 0 on the calling thread and every other one on a
+// thread of its own, started the first time they are needed. Same handshake as trafficWorkers.
+class viewWorkers {
+	public:
+		viewWorkers();
+		void build(SDL_Renderer * renderer, cameraView * views, int count, SDL_Texture * spriteSheet);
+		void stop(void);
+	private:
+		class slot {
+			public:
+				viewWorkers * pool;
+				int 		  view;
+		};
+		std::vector<SDL_Thread *> 	threads;
+		std::vector<SDL_sem *>		wake;
+		std::vector<slot>			slots;
+		SDL_sem *					done;
+		bool 						quit;
+		SDL_Renderer *				renderer;
+		SDL_Texture *				spriteSheet;
+		cameraView *				views;
+		void start(int numThreads);
+		static int work(void * data);
+};
+
+viewWorkers::viewWorkers() {
+	this->done	= NULL;
+	this->quit	= false;
+	this->views	= NULL;
+}
+
+void viewWorkers::start(int numThreads) {
+	this->stop();
+	this->quit = false;
+	this->done = SDL_CreateSemaphore(0);
+	this->slots.resize(numThreads + 1);
+	for (int i = 1; i <= numThreads; i++) {
+		this->slots[i].pool = this;
+		this->slots[i].view = i;
+		this->wake.push_back(SDL_CreateSemaphore(0));
+		this->threads.push_back(SDL_CreateThread(viewWorkers::work, "view", &this->slots[i]));
+	}
+}
+
+void viewWorkers::stop(void) {
+	this->quit = true;
+	for (int i = 0; i < this->threads.size(); i++)
+		SDL_SemPost(this->wake[i]);
+	for (int i = 0; i < this->threads.size(); i++) {
+		SDL_WaitThread(this->threads[i], NULL);
+		SDL_DestroySemaphore(this->wake[i]);
+	}
+	this->threads.clear();
+	this->wake.clear();
+	if (this->done != NULL) {
+		SDL_DestroySemaphore(this->done);
+		this->done = NULL;
+	}
+}
+
+int viewWorkers::work(void * data) {
+	slot * worker = (slot *)data;
+	while (1) {
+		SDL_SemWait(worker->pool->wake[worker->view - 1]);
+		if (worker->pool->quit == true)
+			return 0;
+		worker->pool->views[worker->view].build(worker->pool->renderer, worker->pool->spriteSheet, PROFILE_VIEW_LANE + worker->view);
+		SDL_SemPost(worker->pool->done);
+	}
+}
+
+void viewWorkers::build(SDL_Renderer * renderer, cameraView * views, int count, SDL_Texture * spriteSheet) {
+	if (this->threads.size() < count - 1)
+		this->start(count - 1);
+	this->renderer	  = renderer;
+	this->spriteSheet = spriteSheet;
+	this->views		  = views;
+	for (int i = 1; i < count; i++)
+		SDL_SemPost(this->wake[i - 1]);
+	views[0].build(renderer, spriteSheet, 0);
+	for (int i = 1; i < count; i++)
+		SDL_SemWait(this->done);
+}
+
+viewWorkers viewPool;
+
+// Draws count cameras, each in its viewport, alpha in between the last two ticks. What they share
+// (fog, traffic and ghost places, the shake of every car) is worked out once, on this thread. With
+// the SDL batches in use the cameras are built in parallel on viewPool; line by line drawing and
+// the CPU rasterizer take them one after another.
+void renderViews(SDL_Renderer * renderer, cameraView * views, int count, float alpha, SDL_Texture * spriteSheet, SDL_Texture * backgrounds) {
+	bool parallel = (count > 1) && (rasterizer.enabled == false) && (views[0].road.batched == true) && (views[0].sprites.batched == true);
+	SDL_Rect screen;
+	phaseTimer timer(PHASE_PROJECTION);
+	// --
+	roadFog.update(drawDistance, fogDensity);
+	if (roadCurves.sum1.size() != 2 * segments.size() + 1) roadCurves.build();
+	timer.next(PHASE_SPRITES);
+	carView.build(alpha);
+	ghosts.build(alpha);
+	for (int v = 0; v < count; v++) {
+		views[v].shake  = effectsRandom.randomize();
+		views[v].shake *= (effectsRandom.random(0, 20) - 10) / 10.0;
+	}
+	timer.stop();
+	if (parallel == true)
+		viewPool.build(renderer, views, count, spriteSheet);
+	for (int v = 0; v < count; v++) {
+		if (rasterizer.enabled == true)
+			rasterizer.setViewport(views[v].viewport);
+		else if (renderer != NULL)
+			SDL_RenderSetViewport(renderer, &views[v].viewport);
+		views[v].drawBackgrounds(renderer, backgrounds);
+		if (parallel == false)
+			views[v].build(renderer, spriteSheet, 0);
+		views[v].flush();
+	}
+	screen.x = 0;	screen.w = SCREEN_WIDTH;
+	screen.y = 0;	screen.h = SCREEN_HEIGHT;
+	if (rasterizer.enabled == true)
+		rasterizer.setViewport(screen);
+	else if (renderer != NULL)
+		SDL_RenderSetViewport(renderer, NULL);
+}
+
+// Viewports of count cameras over a width x height window: the whole of it, top and bottom
+// halves, or quadrants for three and four
+void splitScreen(cameraView * views, int count, int width, int height) {
+	if (count == 1)
+		views[0].setViewport(0, 0, width, height);
+	else if (count == 2) {
+		views[0].setViewport(0, 0, width, height / 2);
+		views[1].setViewport(0, height / 2, width, height - height / 2);
+	} else
+		for (int v = 0; v < count; v++)
+			views[v].setViewport((v % 2) * (width / 2), (v / 2) * (height / 2), (v % 2 == 0) ? width / 2 : width - width / 2, (v < 2) ? height / 2 : height - height / 2);
 }
 
 // --------------------------------------------------------------------------------------
 
-float updateCarXOffset(int position, int speed, Car car, Segment carSegment) {
-	Segment segment, playerSegment = findSegment(position + playerZ);
+// Camera depths come from the simulated position, not from the last frame drawn, so traffic moves
+// the same whether frames are drawn or not and whatever their timing
+float updateCarXOffset(int position, int speed, const Car & car, const Segment & carSegment) {
+	const Segment & playerSegment = findSegment(position + playerZ);
+	int   baseIndex = findSegment(position).index;
 	float spriteScale;
-	Car otherCar;
 	float dir;
 	
 	if ((carSegment.index - playerSegment.index) > drawDistance) {
 		return 0.0;
 	} else {
 		for (int i = 1; i < 40; i++) {
-			segment = segments[(carSegment.index + i) % segments.size()];
-			spriteScale = (float)cameraDepth/(float)segment.p1cameraZ;
-			if ((segment.index == playerSegment.index) && (car.speed > speed) && (collision(playerX, playerSprite.w * spriteScale, car.x_offset, car.spriteRect.w * spriteScale, 1.2))) {
+			const Segment & segment = segments[(carSegment.index + i) % segments.size()];
+			spriteScale = (float)cameraDepth/(float)(segment.p1worldZ - (position - ((segment.index < baseIndex) ? trackLength : 0)));
+			if ((segment.index == playerSegment.index) && (car.speed > speed) && (collision(playerX, PLAYER_STRAIGHT_SPRITE.w * spriteScale, car.x_offset, car.spriteRect.w * spriteScale, 1.2))) {
 				if (playerX > 0.5)  dir = -1; else 
 					if (playerX < -0.5) dir = 1;  else
             			dir = (car.x_offset > playerX) ? 1 : -1;
           		return (float)(dir * (1.0 / i) * ((float)(car.speed - speed) / (float)maxSpeed));
        		}
-		    for (int j = 0; j < segment.cars.size(); j++) {
-          		otherCar  = segment.cars[j];
+		    for (int n = traffic.first(segment.index); n != -1; n = traffic.next(n)) {
+          		const Car & otherCar = traffic.cars[n];
           		if ((car.speed > otherCar.speed) && collision(car.x_offset, car.spriteRect.w * spriteScale, otherCar.x_offset, otherCar.spriteRect.w * scaleSprites, 1.2)) {
 					if (otherCar.x_offset > 0.5)  dir = -1; else 
 						if (otherCar.x_offset < -0.5) dir = 1;  else
@@ -761,33 +4282,131 @@ float updateCarXOffset(int position, int speed, Car car, Segment carSegment) {
 	}
 }
 
-void updateCars(int position, int speed) {
-	//Segment segment;
-	Car car;
-	for (int i = 0; i < segments.size(); i++) 
-		for (int j = 0; j < segments[i].cars.size(); j++)
-			segments[i].cars[j].moved = false;
-	for (std::vector<Segment>::iterator itSegment = segments.begin(); itSegment < segments.end(); itSegment++) {
-		for (std::vector<Car>::iterator itCar = itSegment->cars.begin(); itCar < itSegment->cars.end(); itCar++) {
-			if (itCar->moved == false) {
-				car 			= *itCar;
-				car.moved 		= true;
-				car.x_offset	= car.x_offset + updateCarXOffset(position, speed, car, *itSegment);  		
-				car.z_offset    = car.z_offset + dt * car.speed;
-				while (car.z_offset >= trackLength) car.z_offset -= trackLength;
-				while (car.z_offset < 0) 			car.z_offset += trackLength;
-				itSegment->cars.erase(itCar);
-				segments[(car.z_offset/segmentLength) % segments.size()].cars.push_back(car);
-/*			 	segment = findSegment(car.z_offset);
-				segment.cars.push_back(car);
-				segments[segment.index]	= segment;*/				
-			}
-		}
+// Steering and z advance of every car are computed from the previous tick into nextX/nextZ, in
+// contiguous slices spread over a pool of SDL threads (the calling thread takes the first one).
+// Cars are then moved to their new segments in array order on the calling thread, so the result
+// is the same whatever the number of threads.
+class trafficWorkers {
+	public:
+		trafficWorkers();
+		void start(int numThreads);
+		void stop(void);
+		void update(int position, int speed);
+		int  numThreads;
+	private:
+		class slot {
+			public:
+				trafficWorkers * pool;
+				int 			 slice;
+		};
+		static const int 			minCarsPerSlice = 256;	// below that a thread costs more than it saves
+		std::vector<SDL_Thread *> 	threads;
+		std::vector<SDL_sem *>		wake;
+		std::vector<slot>			slots;
+		SDL_sem *					done;
+		bool 						quit;
+		int 						position, speed, numSlices;
+		std::vector<float>			nextX;
+		std::vector<int>			nextZ;
+		void steer(int slice);
+		static int work(void * data);
+};
+
+trafficWorkers::trafficWorkers() {
+	this->numThreads = 1;
+	this->done		 = NULL;
+	this->quit		 = false;
+}
+
+void trafficWorkers::start(int numThreads) {
+	this->stop();
+	this->numThreads = (numThreads < 1) ? 1 : numThreads;
+	this->quit		 = false;
+	this->done		 = SDL_CreateSemaphore(0);
+	this->slots.resize(this->numThreads);
+	for (int i = 1; i < this->numThreads; i++) {
+		this->slots[i].pool  = this;
+		this->slots[i].slice = i;
+		this->wake.push_back(SDL_CreateSemaphore(0));
+		this->threads.push_back(SDL_CreateThread(trafficWorkers::work, "traffic", &this->slots[i]));
+	}
+}
+
+void trafficWorkers::stop(void) {
+	this->quit = true;
+	for (int i = 0; i < this->threads.size(); i++)
+		SDL_SemPost(this->wake[i]);
+	for (int i = 0; i < this->threads.size(); i++) {
+		SDL_WaitThread(this->threads[i], NULL);
+		SDL_DestroySemaphore(this->wake[i]);
+	}
+	this->threads.clear();
+	this->wake.clear();
+	if (this->done != NULL) {
+		SDL_DestroySemaphore(this->done);
+		this->done = NULL;
+	}
+	this->numThreads = 1;
+}
+
+int trafficWorkers::work(void * data) {
+	slot * worker = (slot *)data;
+	while (1) {
+		SDL_SemWait(worker->pool->wake[worker->slice - 1]);
+		if (worker->pool->quit == true)
+			return 0;
+		Uint64 start = SDL_GetPerformanceCounter();
+		worker->pool->steer(worker->slice);
+		if (profiler.enabled == true)
+			profiler.record(PHASE_UPDATE_CARS, start, SDL_GetPerformanceCounter(), PROFILE_TRAFFIC_LANE + worker->slice);
+		SDL_SemPost(worker->pool->done);
 	}
 }
 
+void trafficWorkers::steer(int slice) {
+	int first = (long long)traffic.size() * slice / this->numSlices,
+		last  = (long long)traffic.size() * (slice + 1) / this->numSlices,
+		z;
+	for (int n = first; n < last; n++) {
+		const Car & car = traffic.cars[n];
+		this->nextX[n] 	= car.x_offset + updateCarXOffset(this->position, this->speed, car, segments[traffic.segmentOf(n)]);
+		z = car.z_offset + dt * car.speed;
+		while (z >= trackLength) z -= trackLength;
+		while (z < 0) 			 z += trackLength;
+		this->nextZ[n] = z;
+	}
+}
+
+void trafficWorkers::update(int position, int speed) {
+	this->position	= position;
+	this->speed		= speed;
+	this->numSlices	= min(this->numThreads, max(1, traffic.size() / minCarsPerSlice));
+	this->nextX.resize(traffic.size());
+	this->nextZ.resize(traffic.size());
+	// -- Steer
+	for (int i = 1; i < this->numSlices; i++)
+		SDL_SemPost(this->wake[i - 1]);
+	this->steer(0);
+	for (int i = 1; i < this->numSlices; i++)
+		SDL_SemWait(this->done);
+	// -- Merge
+	for (int n = 0; n < traffic.size(); n++) {
+		traffic.prevX[n] 		 = traffic.cars[n].x_offset;
+		traffic.prevZ[n] 		 = traffic.cars[n].z_offset;
+		traffic.cars[n].x_offset = this->nextX[n];
+		traffic.cars[n].z_offset = this->nextZ[n];
+		traffic.move(n, (this->nextZ[n]/segmentLength) % segments.size());
+	}
+}
+
+trafficWorkers trafficPool;
+
+void updateCars(int position, int speed) {
+	trafficPool.update(position, speed);
+}
+
 void updateBackgrounds(int startPosition, int position, float * skyOffset, float * hillOffset, float * treeOffset) {
-	Segment playerSegment = findSegment(position + playerZ);
+	const Segment & playerSegment = findSegment(position + playerZ);
 	
 	*skyOffset = *skyOffset + skySpeed * playerSegment.curve * (float)(position-startPosition)/(float)segmentLength;
 	while (*skyOffset >= 1) *skyOffset -= 1;
@@ -802,10 +4421,863 @@ void updateBackgrounds(int startPosition, int position, float * skyOffset, float
     while (*treeOffset  < 0) *treeOffset += 1;
 }
 
+// Number of segments the player crossed going from startPosition to position, both ends included.
+// Crossing the lap line counts, a position moved back by a collision gives none.
+int crossedSegments(int startPosition, int position) {
+	int first = findSegment(startPosition + playerZ).index,
+		last  = findSegment(position + playerZ).index;
+	if ((position < startPosition) && (startPosition - position < trackLength / 2))
+		return 0;
+	return (last - first + segments.size()) % segments.size() + 1;
+}
+
+// Whether the player got past car n in the tick from startPosition to position: ahead before, not any more
+bool overtaken(int n, int startPosition, int position) {
+	int length = trackLength,
+		before = ((traffic.prevZ[n] - (int)(startPosition + playerZ)) % length + length) % length,
+		after  = ((traffic.cars[n].z_offset - (int)(position + playerZ)) % length + length) % length;
+	return (before > 0) && (before < length / 2) && ((after == 0) || (after >= length / 2));
+}
+
+// A car driven by the touch state over the tick from startPosition to the already advanced
+// *playerPosition: speed, steering, drift in the curves, off road slowdown and collisions. Used by
+// the player and by the rivals of a split screen race, each with its own x.
+void movePlayer(int startPosition, int * playerPosition, int * playerSpeed, float * x, bool touchUp, bool touchDown, bool touchLeft, bool touchRight) {
+	Segment * playerSegment;
+	int 	position	  = *playerPosition,
+			speed		  = *playerSpeed,
+			firstSegment, numSegments;
+	float	carX		  = *x;
+	bool 	hit, passed = false;
+	// --
+#ifdef _WIN32 						
+	if (touchUp 	== true) speed = speed + (accel * dt);
+	if (touchDown 	== true) speed = speed + (breaking * dt);
+	if ((touchUp 	== false) && (touchDown == false)) speed = speed + (decel * dt);
+#else
+	if (touchDown == false) 
+		speed = speed + (accel * dt);
+	else
+		speed = speed + (breaking * dt);
+#endif
+	if (touchLeft 	== true) carX = carX - (dt * 2.0 * (float)speed/(float)maxSpeed);
+	if (touchRight 	== true) carX = carX + (dt * 2.0 * (float)speed/(float)maxSpeed);
+	// -- Speed limited
+	if (speed < 0) speed = 0;
+	if (speed > maxSpeed) speed = maxSpeed;
+	// X axis movement limited
+	if (carX > 3) carX = 3;
+	if (carX < -3) carX = -3;	
+	
+	carX = carX - ((dt * 2.0 * (float)speed/(float)maxSpeed) * ((float)speed/(float)maxSpeed) * findSegment(position+playerZ).curve * centrifugal);
+
+	phaseTimer timer(PHASE_COLLISION);
+	// Car in offroad X position
+	if ((carX < -1) || (carX > 1)) {
+		// Decelerate to offroad speed
+		if (speed > offRoadLimit)
+			speed = speed + (offRoadDecel * dt);
+		// Check collision with offroad objects, once per crossed segment
+		firstSegment = findSegment(startPosition + playerZ).index;
+		numSegments  = crossedSegments(startPosition, position);
+		for (int j = 0; j < numSegments; j++) {
+			playerSegment = &segments[(firstSegment + j) % segments.size()];
+			if (spriteCollision.hit(playerSegment->index, carX, PLAYER_STRAIGHT_SPRITE.w * scaleSprites)) {
+				audio.play(SFX_SMALL_CRASH, MIX_MAX_VOLUME);
+				speed = maxSpeed / 5;
+				position = playerSegment->p1worldZ - playerZ;
+				while (position >= trackLength)	 position -= trackLength;
+				while (position <  0)	 		 position += trackLength;
+				break;
+			}
+		}
+	}
+	// Check collision with other cars, once per crossed segment
+	firstSegment = findSegment(startPosition + playerZ).index;
+	numSegments  = crossedSegments(startPosition, position);
+	hit 		 = false;
+	for (int j = 0; (j < numSegments) && (hit == false); j++) {
+		playerSegment = &segments[(firstSegment + j) % segments.size()];
+		for (int n = traffic.first(playerSegment->index); n != -1; n = traffic.next(n)) {
+			if (speed > traffic.cars[n].speed) {
+				if (collision(carX, PLAYER_STRAIGHT_SPRITE.w * scaleSprites, traffic.cars[n].x_offset, traffic.cars[n].spriteRect.w * scaleSprites, 0.8)) {
+					audio.play(SFX_BIG_CRASH, MIX_MAX_VOLUME);
+					speed    = traffic.cars[n].speed * (traffic.cars[n].speed / speed);
+					position = traffic.cars[n].z_offset - playerZ;
+					while (position >= trackLength)	 position -= trackLength;
+					while (position <  0)	 		 position += trackLength;
+					hit 	 = true;
+					break;            		
+				}
+				passed = passed || overtaken(n, startPosition, position);
+			}
+		}			
+	}
+	if (passed == true)
+		audio.play(SFX_PASS, MIX_MAX_VOLUME / 2);
+	timer.stop();
+
+	*playerPosition = position;
+	*playerSpeed	= speed;
+	*x				= carX;
+}
+
+// One fixed step of the simulation: the player moves from the touch state, then traffic,
+// backgrounds and collisions follow
+void update(int * playerPosition, int * playerSpeed, bool touchUp, bool touchDown, bool touchLeft, bool touchRight, float * skyOffset, float * hillOffset, float * treeOffset) {
+	int 	startPosition = *playerPosition,
+			position	  = *playerPosition;
+	phaseTimer timer(PHASE_UPDATE_CARS);
+	// --
+	position = position + dt * *playerSpeed;
+	while (position >= trackLength) position -= trackLength;
+	while (position < 0) position += trackLength;	
+	if (endless.enabled == true) endless.advance(position);
+
+	updateCars(position, *playerSpeed);
+	timer.next(PHASE_BACKGROUNDS);
+	updateBackgrounds(startPosition, position, skyOffset, hillOffset, treeOffset);
+	timer.stop();
+
+	*playerPosition = position;
+	movePlayer(startPosition, playerPosition, playerSpeed, &playerX, touchUp, touchDown, touchLeft, touchRight);
+}
+
+// Another car of a split screen race, sharing the track and the traffic of the player. Traffic only
+// makes way for the player (playerX), so a race records and replays from the player keys alone.
+class localPlayer {
+	public:
+		localPlayer();
+		void  start(int position);
+		void  update(void);
+		void  press(int player, SDL_Keycode key, bool down);
+		int   position, previousPosition, speed;
+		float x, previousX, skyOffset, hillOffset, treeOffset;
+		bool  touchUp, touchDown, touchLeft, touchRight;
+};
+
+localPlayer::localPlayer() {
+	this->start(0);
+}
+
+void localPlayer::start(int position) {
+	this->position	 = this->previousPosition = position;
+	this->speed		 = 0;
+	this->x			 = this->previousX = 0;
+	this->skyOffset	 = this->hillOffset = this->treeOffset = 0;
+	this->touchUp	 = this->touchDown = this->touchLeft = this->touchRight = false;
+}
+
+// After the traffic of the tick moved, like update() does for the player
+void localPlayer::update(void) {
+	int startPosition = this->position;
+	// --
+	this->previousPosition = this->position;
+	this->previousX		   = this->x;
+	this->position		   = this->position + dt * this->speed;
+	while (this->position >= trackLength) this->position -= trackLength;
+	while (this->position < 0) this->position += trackLength;
+	updateBackgrounds(startPosition, this->position, &this->skyOffset, &this->hillOffset, &this->treeOffset);
+	movePlayer(startPosition, &this->position, &this->speed, &this->x, this->touchUp, this->touchDown, this->touchLeft, this->touchRight);
+}
+
+// Up, down, left and right of every player on one keyboard, player 1 being on the arrows
+const SDL_Keycode playerKeys[MAX_VIEWS][4] = {
+	{ SDLK_UP,	 SDLK_DOWN,	SDLK_LEFT, SDLK_RIGHT },
+	{ SDLK_w,	 SDLK_s,	SDLK_a,	   SDLK_d	  },
+	{ SDLK_i,	 SDLK_k,	SDLK_j,	   SDLK_l	  },
+	{ SDLK_KP_8, SDLK_KP_5,	SDLK_KP_4, SDLK_KP_6  }
+};
+
+void localPlayer::press(int player, SDL_Keycode key, bool down) {
+	if (key == playerKeys[player][0]) this->touchUp	   = down;
+	if (key == playerKeys[player][1]) this->touchDown  = down;
+	if (key == playerKeys[player][2]) this->touchLeft  = down;
+	if (key == playerKeys[player][3]) this->touchRight = down;
+}
+
+// Position drawn alpha in between the last two ticks, previous may be on the lap before
+int renderedPosition(int previous, int position, float alpha) {
+	int distance = position - previous,
+		rendered;
+	// --
+	if (distance < -trackLength / 2) distance += trackLength; // crossed the lap line
+	rendered = previous + distance * alpha;
+	while (rendered >= trackLength) rendered -= trackLength;
+	while (rendered <  0)	 		rendered += trackLength;
+	return rendered;
+}
+
+// Plays a replay back headless and as fast as it goes: the simulation of every tick and the keyframe
+// checks, nothing drawn. Exits with 1 when it diverged, so replays double as regression tests.
+//   CrazzyRace --verify-replay file
+int verifyReplay(const char * filename) {
+	replayFile replay;
+	int		position = 0,
+			speed	 = 0;
+	float	skyOffset = 0, hillOffset = 0, treeOffset = 0;
+	bool	touchUp, touchDown, touchLeft, touchRight;
+	Uint64	start;
+	double	seconds;
+	// --
+	if ((replay.load(filename) == false) || (replay.buildWorld() == false))
+		return 1;
+	trafficPool.start(SDL_GetCPUCount());
+	start = SDL_GetPerformanceCounter();
+	while (replay.play(position, speed, &touchUp, &touchDown, &touchLeft, &touchRight) == true)
+		update(&position, &speed, touchUp, touchDown, touchLeft, touchRight, &skyOffset, &hillOffset, &treeOffset);
+	seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+	trafficPool.stop();
+	std::cout << "replay: " << replay.tick << " ticks in " << 1000.0 * seconds << " ms (" << (replay.tick * dt) / seconds << "x real time), "
+			  << replay.keyframes << " keyframes, ";
+	if (replay.diverged < 0)
+		std::cout << "no divergence" << std::endl;
+	else
+		std::cout << "diverged at tick " << replay.diverged << std::endl;
+	return (replay.diverged < 0) ? 0 : 1;
+}
+
+// Times the projection pass alone, stepping a quarter of segment at a time once around the track
+int benchProjection(void) {
+	int		passes = 0;
+	float	checksum = 0;
+	Uint64	start, elapsed;
+	roadProjection projection;
+	// --
+	resetRoad();
+	start = SDL_GetPerformanceCounter();
+	for (int position = 0; position < trackLength; position += segmentLength / 4, passes++) {
+		projection.project(position, findSegment(position).index, (float)(position%segmentLength)/(float)segmentLength, playerX, findSegment(position + playerZ).p1worldY, drawDistance, SCREEN_WIDTH, SCREEN_HEIGHT);
+		checksum += projection.p2screenY[drawDistance - 1];
+	}
+	elapsed = SDL_GetPerformanceCounter() - start;
+	std::cout << "projection: " << passes << " passes x " << drawDistance << " segments, " << (1e9 * elapsed / SDL_GetPerformanceFrequency()) / ((double)passes * drawDistance) << " ns/segment (checksum " << checksum << ")" << std::endl;
+	return 0;
+}
+
+// Records the road of frames all along the track with the generic segment renderer (lane count
+// read at run time and fog always looked up, as it used to be) and with the instantiation
+// renderRoad picks, for 2, 3 and 4 lanes with and without fog. Both go to the CPU rasterizer,
+// every 25th frame is rasterized to check they draw the same image.
+int benchRoad(void) {
+	const int 	frames = 500;
+	int			lanes  = numLanes,
+				position;
+	bool		identical;
+	float		playerY;
+	Uint64		genericTicks, specializedTicks, start;
+	Uint32		image;
+	roadBatch	road;
+	roadProjection projection;
+	// --
+	resetRoad();
+	rasterizer.enabled = true;
+	for (numLanes = 2; numLanes <= 4; numLanes++)
+		for (int fogged = 1; fogged >= 0; fogged--) {
+			roadFog.update(drawDistance, fogged ? fogDensity : 0);
+			genericTicks = specializedTicks = 0;
+			identical	 = true;
+			for (int frame = 0; frame < frames; frame++) {
+				position = (long long)trackLength * frame / frames;
+				const Segment & playerSegment = findSegment(position + playerZ);
+				playerY = playerSegment.p1worldY + (playerSegment.p2worldY - playerSegment.p1worldY) * (float)((int)(position + playerZ) % segmentLength) / segmentLength;
+				projection.project(position, findSegment(position).index, (float)(position % segmentLength) / segmentLength, 0, playerY, drawDistance, SCREEN_WIDTH, SCREEN_HEIGHT);
+				rasterizer.begin(SCREEN_WIDTH, SCREEN_HEIGHT);
+				road.begin(NULL, SCREEN_WIDTH, SCREEN_HEIGHT);
+				start = SDL_GetPerformanceCounter();
+				renderRoad<0, true>(road, SCREEN_WIDTH, SCREEN_HEIGHT, numLanes, findSegment(position).index, projection, roadFog, drawDistance);
+				genericTicks += SDL_GetPerformanceCounter() - start;
+				if (frame % 25 == 0) {
+					rasterizer.flush();
+					image = rasterizer.checksum();
+				}
+				rasterizer.begin(SCREEN_WIDTH, SCREEN_HEIGHT);
+				start = SDL_GetPerformanceCounter();
+				renderRoad(road, SCREEN_WIDTH, SCREEN_HEIGHT, numLanes, findSegment(position).index, projection, roadFog, drawDistance, fogged == 1);
+				specializedTicks += SDL_GetPerformanceCounter() - start;
+				if (frame % 25 == 0) {
+					rasterizer.flush();
+					identical = identical && (image == rasterizer.checksum());
+				}
+			}
+			std::cout << "road " << numLanes << " lanes, fog " << (fogged ? "on " : "off") << ": generic " << (1e6 * genericTicks / SDL_GetPerformanceFrequency()) / frames << " us/frame, specialized "
+					  << (1e6 * specializedTicks / SDL_GetPerformanceFrequency()) / frames << " us/frame (" << (double)genericTicks / specializedTicks << "x)"
+					  << (identical ? "" : ", images DIFFER") << std::endl;
+		}
+	numLanes		   = lanes;
+	rasterizer.enabled = false;
+	return 0;
+}
+
+// Times the fog factors of a whole frame of road, from pow() per segment as before and from the table,
+// and folding them into the segment colors. Every fogged segment also used to cost one blended fill.
+int benchFog(void) {
+	int		frames	= 1000,
+			fills	= 0;
+	float	checksum = 0;
+	Uint32	colors	 = 0;
+	Uint64	start, powTicks, tableTicks, foldTicks;
+	SDL_Color color;
+	// --
+	resetRoad();
+	start = SDL_GetPerformanceCounter();
+	for (int frame = 0; frame < frames; frame++)
+		for (int i = 0; i < drawDistance; i++)
+			checksum += 1.0/pow((float)__E, (float)(i)/(float)(drawDistance) * (float)(i)/(float)(drawDistance) * (float)(fogDensity + frame % 2));
+	powTicks = SDL_GetPerformanceCounter() - start;
+	start = SDL_GetPerformanceCounter();
+	for (int frame = 0; frame < frames; frame++) {
+		roadFog.update(drawDistance, fogDensity);
+		for (int i = 0; i < drawDistance; i++)
+			checksum += roadFog.factor[i];
+	}
+	tableTicks = SDL_GetPerformanceCounter() - start;
+	start = SDL_GetPerformanceCounter();
+	for (int frame = 0; frame < frames; frame++) {
+		for (int i = 0; i < drawDistance; i++) {
+			const Segment & segment = segments[i % segments.size()];
+			color	= roadFog.apply(segment.colorGrass, i);		colors += color.r + color.g + color.b;
+			color	= roadFog.apply(segment.colorRumble, i);	colors += color.r + color.g + color.b;
+			color	= roadFog.apply(segment.colorRoad, i);		colors += color.r + color.g + color.b;
+			color	= roadFog.apply(segment.colorLane, i);		colors += color.r + color.g + color.b;
+		}
+	}
+	foldTicks = SDL_GetPerformanceCounter() - start;
+	for (int i = 0; i < drawDistance; i++)
+		if (roadFog.factor[i] < 1) fills++;
+	std::cout << "fog: pow " << (1e9 * powTicks / SDL_GetPerformanceFrequency()) / ((double)frames * drawDistance) << " ns/segment, table "
+			  << (1e9 * tableTicks / SDL_GetPerformanceFrequency()) / ((double)frames * drawDistance) << " ns/segment, folding into 4 colors "
+			  << (1e9 * foldTicks / SDL_GetPerformanceFrequency()) / ((double)frames * drawDistance) << " ns/segment, "
+			  << fills << " blended fills saved per frame (checksum " << checksum << " " << colors << ")" << std::endl;
+	return 0;
+}
+
+// Walks the roadside sprites the way cameraView::build() does, drawDistance segments back to front from every
+// segment of the track, in the CSR array and in one std::vector per segment as they used to be kept.
+// Built with -DCOUNT_ALLOCATIONS it also counts the heap blocks each layout takes to build.
+int benchSprites(void) {
+	std::vector< std::vector<Sprite> > perSegment;
+	unsigned long csrAllocations = 0, vectorAllocations = 0;
+	long long	  visited = 0;
+	float		  checksum = 0;
+	Uint64		  start, csrTicks, vectorTicks;
+	// --
+	resetRoad();
+#ifdef COUNT_ALLOCATIONS
+	csrAllocations = heapAllocations();
+#endif
+	resetSprites();
+#ifdef COUNT_ALLOCATIONS
+	csrAllocations	  = heapAllocations() - csrAllocations;
+	vectorAllocations = heapAllocations();
+#endif
+	perSegment.resize(segments.size());
+	for (int n = 0; n < segments.size(); n++)
+		for (int i = roadside.first(n); i < roadside.first(n + 1); i++)
+			perSegment[n].push_back(roadside.sprites[i]);
+#ifdef COUNT_ALLOCATIONS
+	vectorAllocations = heapAllocations() - vectorAllocations;
+#endif
+	start = SDL_GetPerformanceCounter();
+	for (int base = 0; base < segments.size(); base++)
+		for (int i = drawDistance - 1; i > 0; i--) {
+			int n = (base + i) % segments.size();
+			for (int j = roadside.first(n); j < roadside.first(n + 1); j++, visited++)
+				checksum += roadside.sprites[j].x_offset * roadside.sprites[j].spriteRect.w;
+		}
+	csrTicks = SDL_GetPerformanceCounter() - start;
+	start = SDL_GetPerformanceCounter();
+	for (int base = 0; base < segments.size(); base++)
+		for (int i = drawDistance - 1; i > 0; i--) {
+			const std::vector<Sprite> & sprites = perSegment[(base + i) % segments.size()];
+			for (int j = 0; j < sprites.size(); j++)
+				checksum -= sprites[j].x_offset * sprites[j].spriteRect.w;
+		}
+	vectorTicks = SDL_GetPerformanceCounter() - start;
+	std::cout << "sprites: " << roadside.size() << " on " << segments.size() << " segments, " << visited << " visits. "
+			  << "CSR " << (1e9 * csrTicks / SDL_GetPerformanceFrequency()) / visited << " ns/sprite, " << csrAllocations << " allocations; "
+			  << "vector per segment " << (1e9 * vectorTicks / SDL_GetPerformanceFrequency()) / visited << " ns/sprite, " << vectorAllocations << " allocations"
+			  << " (checksum " << checksum << ")" << std::endl;
+	return 0;
+}
+
+// Times updateCars alone over 300 frames at half speed with 1, 2, 4 and 8 threads (or only the given
+// count), the number of cars is the scaling knob. Equal checksums mean bit identical traffic.
+int benchTraffic(int cars, int threads) {
+	int		position, 
+			speed	 = maxSpeed / 2,
+			frames	 = 300;
+	Uint32	checksum, bits;
+	Uint64	start, elapsed;
+	// --
+	resetRoad();
+	for (int numThreads = 1; numThreads <= 8; numThreads *= 2) {
+		if ((threads > 0) && (numThreads != threads))
+			continue;
+		seedRandom(1);
+		resetCars(cars);
+		trafficPool.start(numThreads);
+		position = 0;
+		start	 = SDL_GetPerformanceCounter();
+		for (int frame = 0; frame < frames; frame++) {
+			position = position + dt * speed;
+			while (position >= trackLength) position -= trackLength;
+			updateCars(position, speed);
+		}
+		elapsed  = SDL_GetPerformanceCounter() - start;
+		trafficPool.stop();
+		checksum = 0;
+		for (int n = 0; n < traffic.size(); n++) {
+			memcpy(&bits, &traffic.cars[n].x_offset, sizeof(bits));
+			checksum = checksum * 31 + (bits ^ traffic.cars[n].z_offset);
+		}
+		std::cout << "traffic: " << cars << " cars, " << numThreads << " threads, " << (1000.0 * elapsed / SDL_GetPerformanceFrequency()) / frames << " ms/frame (checksum " << std::hex << checksum << std::dec << ")" << std::endl;
+	}
+	return 0;
+}
+
+// -- Deterministic benchmark: fixed seed, scripted input and N ticks without a window, optionally
+// rendering every tick into an offscreen software target, or with the CPU rasterizer (--cpu, on
+// as many threads as given or as cores). Phase timings are written as JSON, the last frame drawn
+// as a BMP with --frame-out, every phase of every thread as a Chrome trace with --chrome-trace,
+// the run as a replay with --record. Every --ghost races a recorded run along. With --views N the
+// trace also drives N - 1 more cars spread around the track, each on its own split screen camera.
+//   CrazzyRace --benchmark [--frames N] [--seed S] [--track file | --endless] [--trace file] [--render | --cpu [threads]] [--size WxH] [--views N] [--sprite-density N] [--draw-distance N] [--out file] [--frame-out file] [--chrome-trace file] [--record file] [--ghost file]...
+// A trace has one "ticks keys" step per line, keys being any of U D L R (- for none); it starts
+// over when it runs out before the frames do.
+
+class traceStep {
+	public:
+		int  ticks;
+		bool touchUp, touchDown, touchLeft, touchRight;
+};
+
+const char * defaultTrace[] = { "120 U", "30 UL", "60 U", "45 UR", "150 U", "20 D", "40 UL", "90 UR", "60 -", "200 U", "50 ULL", "25 D" };
+
+traceStep parseTraceStep(const char * line) {
+	traceStep step;
+	char keys[16] = "-";
+	// --
+	step.ticks = 0;
+	sscanf(line, "%d %15s", &step.ticks, keys);
+	step.touchUp	= (strchr(keys, 'U') != NULL);
+	step.touchDown	= (strchr(keys, 'D') != NULL);
+	step.touchLeft	= (strchr(keys, 'L') != NULL);
+	step.touchRight	= (strchr(keys, 'R') != NULL);
+	return step;
+}
+
+void writePercentiles(std::ostream & out, const char * name, std::vector<double> & samples, bool last) {
+	double sum = 0;
+	// --
+	std::sort(samples.begin(), samples.end());
+	for (int i = 0; i < samples.size(); i++) sum += samples[i];
+	out << "    \"" << name << "\": { \"mean\": " << sum / samples.size()
+		<< ", \"p50\": " << samples[(samples.size() - 1) * 50 / 100]
+		<< ", \"p90\": " << samples[(samples.size() - 1) * 90 / 100]
+		<< ", \"p99\": " << samples[(samples.size() - 1) * 99 / 100]
+		<< ", \"max\": " << samples.back() << " }" << (last ? "" : ",") << std::endl;
+}
+
+int benchGame(int argc, char** argv) {
+	int		frames 	 = 3000,
+			seed	 = 1,
+			position = 0,
+			speed	 = 0,
+			step	 = 0,
+			stepTick = 0;
+	bool	rendering 	= false,
+			endlessRoad	= false;
+	int		cpuThreads	= 0,
+			numViews	= 1;
+	float	skyOffset = 0, hillOffset = 0, treeOffset = 0;
+	cameraView	views[MAX_VIEWS];
+	localPlayer	rivals[MAX_VIEWS];
+	const char * traceFile = NULL,
+			   * trackFile = NULL,
+			   * outFile   = NULL,
+			   * frameFile = NULL,
+			   * chromeFile = NULL,
+			   * recordFile = NULL;
+	replayFile replay;
+	std::vector<traceStep> trace;
+	std::vector<double>	   samples[NUM_PHASES + 1];
+	SDL_Surface	 * target	   = NULL;
+	SDL_Renderer * renderer	   = NULL;
+	SDL_Texture	 * spriteSheet = NULL,
+				 * backgrounds = NULL;
+	Uint64	frameStart;
+	Uint32	checksum, bits;
+	char 	line[256];
+	// --
+	for (int i = 2; i < argc; i++) {
+		if 		((strcmp(argv[i], "--frames") == 0) && (i + 1 < argc)) frames 	 = atoi(argv[++i]);
+		else if ((strcmp(argv[i], "--seed")   == 0) && (i + 1 < argc)) seed   	 = atoi(argv[++i]);
+		else if ((strcmp(argv[i], "--trace")  == 0) && (i + 1 < argc)) traceFile = argv[++i];
+		else if ((strcmp(argv[i], "--track")  == 0) && (i + 1 < argc)) trackFile = argv[++i];
+		else if ((strcmp(argv[i], "--out")    == 0) && (i + 1 < argc)) outFile 	 = argv[++i];
+		else if ((strcmp(argv[i], "--frame-out") == 0) && (i + 1 < argc)) frameFile = argv[++i];
+		else if ((strcmp(argv[i], "--chrome-trace") == 0) && (i + 1 < argc)) chromeFile = argv[++i];
+		else if ((strcmp(argv[i], "--record") == 0) && (i + 1 < argc)) recordFile = argv[++i];
+		else if ((strcmp(argv[i], "--ghost") == 0) && (i + 1 < argc)) {
+			if (ghosts.add(argv[++i]) == false)
+				return 1;
+		}
+		else if ((strcmp(argv[i], "--size")   == 0) && (i + 1 < argc)) sscanf(argv[++i], "%dx%d", &SCREEN_WIDTH, &SCREEN_HEIGHT);
+		else if ((strcmp(argv[i], "--sprite-density") == 0) && (i + 1 < argc)) spriteDensity = max(1, atoi(argv[++i]));
+		else if ((strcmp(argv[i], "--draw-distance") == 0) && (i + 1 < argc)) drawDistance = max(2, atoi(argv[++i]));
+		else if ((strcmp(argv[i], "--views")  == 0) && (i + 1 < argc)) numViews  = min(MAX_VIEWS, max(1, atoi(argv[++i])));
+		else if  (strcmp(argv[i], "--render") == 0) 				   rendering = true;
+		else if  (strcmp(argv[i], "--endless") == 0) 				   endlessRoad = true;
+		else if  (strcmp(argv[i], "--cpu") == 0) {
+			rendering  = true;
+			cpuThreads = ((i + 1 < argc) && (atoi(argv[i + 1]) > 0)) ? atoi(argv[++i]) : SDL_GetCPUCount();
+		}
+	}
+
+	if (traceFile != NULL) {
+		std::ifstream in(traceFile);
+		while (in.getline(line, sizeof(line)))
+			if (parseTraceStep(line).ticks > 0) trace.push_back(parseTraceStep(line));
+	} else
+		for (int i = 0; i < sizeof(defaultTrace) / sizeof(defaultTrace[0]); i++)
+			trace.push_back(parseTraceStep(defaultTrace[i]));
+	if (trace.size() == 0) {
+		std::cout << "Empty trace" << std::endl;
+		return 1;
+	}
+
+	if (rendering == true) {
+		if (IMG_Init(IMG_INIT_PNG) != IMG_INIT_PNG) {
+			std::cout << "IMG_Init Error: " << IMG_GetError() << std::endl;
+			return 1;
+		}
+	}
+	if (cpuThreads > 0) {
+		if ((rasterizer.loadImage(RASTER_SPRITES, SPRITES_FILE) == false) || (rasterizer.loadImage(RASTER_BACKGROUNDS, BACKGROUNDS_FILE) == false)) {
+			std::cout << "IMG_Load Error: " << IMG_GetError() << std::endl;
+			return 1;
+		}
+		rasterizer.start(cpuThreads);
+		rasterizer.enabled = true;
+	} else if (rendering == true) {
+		target 		= SDL_CreateRGBSurfaceWithFormat(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, SDL_PIXELFORMAT_ARGB8888);
+		renderer	= SDL_CreateSoftwareRenderer(target);
+		if (renderer == NULL) {
+			std::cout << "SDL_CreateSoftwareRenderer Error: " << SDL_GetError() << std::endl;
+			return 1;
+		}
+		spriteSheet = loadSpriteSheet(renderer, SPRITES_FILE);
+		backgrounds = loadSpriteSheet(renderer, BACKGROUNDS_FILE);
+	}
+
+	if ((endlessRoad == true) && (numViews > 1)) {
+		std::cout << "Split screen needs a fixed track, the endless road is only built ahead of the player" << std::endl;
+		return 1;
+	}
+	if ((ghosts.fits(trackFile, endlessRoad ? seed : 0) == false) || (buildWorld(seed, endlessRoad ? seed : 0, trackFile) == false))
+		return 1;
+	// The projection reads the curve prefix sums one lap ahead at most, a short track can't be drawn further
+	if (drawDistance > (int)segments.size()) {
+		std::cout << "draw distance clamped to the " << segments.size() << " segments of the track" << std::endl;
+		drawDistance = segments.size();
+	}
+	// Rivals drive the same trace, spread evenly around the track
+	for (int v = 1; v < numViews; v++)
+		rivals[v].start((long long)trackLength * v / numViews);
+	splitScreen(views, numViews, SCREEN_WIDTH, SCREEN_HEIGHT);
+	if ((recordFile != NULL) && (replay.start(seed, endlessRoad ? seed : 0, trackFile) == false))
+		return 1;
+	trafficPool.start(SDL_GetCPUCount());
+	memset(phaseTicks, 0, sizeof(phaseTicks));
+	if (chromeFile != NULL)
+		profiler.enable(true);
+
+	for (int frame = 0; frame < frames; frame++) {
+		if (stepTick++ == trace[step].ticks) {
+			step 	 = (step + 1) % trace.size();
+			stepTick = 1;
+		}
+		if (recordFile != NULL)
+			replay.record(position, speed, trace[step].touchUp, trace[step].touchDown, trace[step].touchLeft, trace[step].touchRight);
+		frameStart = SDL_GetPerformanceCounter();
+		update(&position, &speed, trace[step].touchUp, trace[step].touchDown, trace[step].touchLeft, trace[step].touchRight, &skyOffset, &hillOffset, &treeOffset);
+		ghosts.advance();
+		for (int v = 1; v < numViews; v++) {
+			rivals[v].touchUp	 = trace[step].touchUp;		rivals[v].touchDown	 = trace[step].touchDown;
+			rivals[v].touchLeft	 = trace[step].touchLeft;	rivals[v].touchRight = trace[step].touchRight;
+			rivals[v].update();
+		}
+		views[0].position	= position;				views[0].playerX	= playerX;
+		views[0].speed		= speed;				views[0].steer		= trace[step].touchRight - trace[step].touchLeft;
+		views[0].skyOffset	= skyOffset;			views[0].hillOffset	= hillOffset;			views[0].treeOffset = treeOffset;
+		for (int v = 1; v < numViews; v++) {
+			views[v].position	= rivals[v].position;	views[v].playerX	= rivals[v].x;
+			views[v].speed		= rivals[v].speed;		views[v].steer		= trace[step].touchRight - trace[step].touchLeft;
+			views[v].skyOffset	= rivals[v].skyOffset;	views[v].hillOffset	= rivals[v].hillOffset;	views[v].treeOffset = rivals[v].treeOffset;
+		}
+		if (rasterizer.enabled == true) {
+			rasterizer.begin(SCREEN_WIDTH, SCREEN_HEIGHT);
+			rasterizer.fill(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, SKY_COLOR);
+			renderViews(NULL, views, numViews, 1.0, NULL, NULL);
+			phaseTimer timer(PHASE_RASTER);
+			rasterizer.flush();
+		} else if (rendering == true) {
+			SDL_SetRenderDrawColor(renderer, SKY_COLOR.r, SKY_COLOR.g, SKY_COLOR.b, SKY_COLOR.a);	
+			SDL_RenderClear(renderer);
+			renderViews(renderer, views, numViews, 1.0, spriteSheet, backgrounds);
+		}
+		samples[NUM_PHASES].push_back(1e6 * (SDL_GetPerformanceCounter() - frameStart) / SDL_GetPerformanceFrequency());
+		for (int i = 0; i < NUM_PHASES; i++) {
+			samples[i].push_back(1e6 * phaseTicks[i] / SDL_GetPerformanceFrequency());
+			phaseTicks[i] = 0;
+		}
+	}
+
+	// Same seed and trace must give the same checksum, whatever the machine or thread count
+	memcpy(&bits, &playerX, sizeof(bits));
+	checksum = position * 31 + speed;
+	checksum = checksum * 31 + bits;
+	for (int n = 0; n < traffic.size(); n++) {
+		memcpy(&bits, &traffic.cars[n].x_offset, sizeof(bits));
+		checksum = checksum * 31 + (bits ^ traffic.cars[n].z_offset);
+	}
+
+	std::ofstream file;
+	if (outFile != NULL) file.open(outFile);
+	std::ostream & out = (outFile != NULL) ? file : std::cout;
+	out << "{" << std::endl;
+	out << "  \"seed\": " << seed << ", \"frames\": " << frames << ", \"cars\": " << traffic.cars.size() << ", \"render\": " << (rendering ? "true" : "false")
+		<< ", \"width\": " << SCREEN_WIDTH << ", \"height\": " << SCREEN_HEIGHT << ", \"spriteDensity\": " << spriteDensity << ", \"drawDistance\": " << drawDistance << ", \"segments\": " << segments.size() << ", \"generated\": " << endless.generated << ", \"checksum\": \"" << std::hex << checksum << std::dec << "\"," << std::endl;
+	if (rasterizer.enabled == true)
+		out << "  \"cpuThreads\": " << rasterizer.numThreads << ", \"image\": \"" << std::hex << rasterizer.checksum() << std::dec << "\"," << std::endl;
+	out << "  \"unit\": \"us\"," << std::endl;
+	out << "  \"phases\": {" << std::endl;
+	for (int i = 0; i < NUM_PHASES; i++)
+		writePercentiles(out, phaseNames[i], samples[i], false);
+	writePercentiles(out, "frame", samples[NUM_PHASES], true);
+	out << "  }" << std::endl << "}" << std::endl;
+
+	if (chromeFile != NULL) {
+		profiler.enable(false);
+		if (profiler.exportTrace(chromeFile) == false)
+			std::cout << "Can't write " << chromeFile << std::endl;
+	}
+	if ((recordFile != NULL) && (replay.save(recordFile) == false))
+		std::cout << "Can't write " << recordFile << std::endl;
+	ghosts.clear();
+	if (frameFile != NULL) {
+		if (rasterizer.enabled == true)
+			rasterizer.save(frameFile);
+		else if (target != NULL)
+			SDL_SaveBMP(target, frameFile);
+	}
+	if (rasterizer.enabled == true) {
+		rasterizer.stop();
+		rasterizer.enabled = false;
+	} else if (rendering == true) {
+		SDL_DestroyTexture(backgrounds);
+		SDL_DestroyTexture(spriteSheet);
+		SDL_DestroyRenderer(renderer);
+		SDL_FreeSurface(target);
+	}
+	if (rendering == true)
+		IMG_Quit();
+	trafficPool.stop();
+	viewPool.stop();
+	return 0;
+}
+
+// Draws the same frames at 1080p and 4K with the CPU rasterizer on 1, 2, 4 and 8 threads. The
+// commands of each frame are recorded once and rasterized with every thread count in turn, all of
+// them must give the same image.
+int benchRaster(void) {
+	const int	sizes[2][2]	  = { { 1920, 1080 }, { 3840, 2160 } },
+				threads[4]	  = { 1, 2, 4, 8 },
+				frames		  = 60,
+				ticksPerFrame = 10;
+	int		position = 0,
+			speed	 = 0,
+			step	 = 0,
+			stepTick = 0;
+	float	skyOffset = 0, hillOffset = 0, treeOffset = 0;
+	bool	identical[2] = { true, true };
+	Uint32	checksum[2]	 = { 0, 0 },
+			image, firstImage = 0;
+	Uint64	elapsed[2][4] = { { 0, 0, 0, 0 }, { 0, 0, 0, 0 } },
+			start;
+	std::vector<traceStep> trace;
+	cameraView view;
+	// --
+	for (int i = 0; i < sizeof(defaultTrace) / sizeof(defaultTrace[0]); i++)
+		trace.push_back(parseTraceStep(defaultTrace[i]));
+	if ((IMG_Init(IMG_INIT_PNG) != IMG_INIT_PNG) ||
+		(rasterizer.loadImage(RASTER_SPRITES, SPRITES_FILE) == false) || (rasterizer.loadImage(RASTER_BACKGROUNDS, BACKGROUNDS_FILE) == false)) {
+		std::cout << "IMG_Load Error: " << IMG_GetError() << std::endl;
+		return 1;
+	}
+	seedRandom(1);
+	resetRoad();
+	resetSprites();
+	spriteCollision.build();
+	resetCars(totalCars);
+	rasterizer.start(threads[3]);
+	rasterizer.enabled = true;
+	for (int frame = 0; frame < frames; frame++) {
+		for (int tick = 0; tick < ticksPerFrame; tick++) {
+			if (stepTick++ == trace[step].ticks) {
+				step 	 = (step + 1) % trace.size();
+				stepTick = 1;
+			}
+			update(&position, &speed, trace[step].touchUp, trace[step].touchDown, trace[step].touchLeft, trace[step].touchRight, &skyOffset, &hillOffset, &treeOffset);
+		}
+		for (int size = 0; size < 2; size++) {
+			SCREEN_WIDTH  = sizes[size][0];
+			SCREEN_HEIGHT = sizes[size][1];
+			rasterizer.begin(SCREEN_WIDTH, SCREEN_HEIGHT);
+			rasterizer.fill(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, SKY_COLOR);
+			view.position	= position;			view.playerX	= playerX;
+			view.speed		= speed;			view.steer		= trace[step].touchRight - trace[step].touchLeft;
+			view.skyOffset	= skyOffset;		view.hillOffset	= hillOffset;		view.treeOffset = treeOffset;
+			view.setViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+			renderViews(NULL, &view, 1, 1.0, NULL, NULL);
+			for (int t = 0; t < 4; t++) {
+				start = SDL_GetPerformanceCounter();
+				rasterizer.rasterize(threads[t]);
+				elapsed[size][t] += SDL_GetPerformanceCounter() - start;
+				image = rasterizer.checksum();
+				if (t == 0) {
+					firstImage 	   = image;
+					checksum[size] = checksum[size] * 31 + image;
+				} else if (image != firstImage)
+					identical[size] = false;
+			}
+		}
+	}
+	for (int size = 0; size < 2; size++) {
+		std::cout << "raster " << sizes[size][0] << "x" << sizes[size][1] << ":";
+		for (int t = 0; t < 4; t++)
+			std::cout << " " << threads[t] << (t == 0 ? " thread " : " threads ") << (1000.0 * elapsed[size][t] / SDL_GetPerformanceFrequency()) / frames << " ms/frame ("
+					  << (double)elapsed[size][0] / elapsed[size][t] << "x)" << (t == 3 ? "" : ",");
+		std::cout << " image " << std::hex << checksum[size] << std::dec << (identical[size] ? " (same on every thread count)" : " (DIFFERS between thread counts)") << std::endl;
+	}
+	rasterizer.stop();
+	rasterizer.enabled = false;
+	IMG_Quit();
+	return (identical[0] && identical[1]) ? 0 : 1;
+}
+
+// Loads the given images (by default the ones the game starts with) one after the other the way
+// loadSpriteSheet does, then with the asset loader on every core: without the cache, and twice
+// with it so the last run starts warm. Textures go to an offscreen software renderer.
+int benchAssets(int argc, char** argv) {
+	const char * defaults[] = { SPRITES_FILE, BACKGROUNDS_FILE, "./images/font/speedFont.png" },
+			   * runs[]		= { "parallel", "parallel, cache", "parallel, warm cache" };
+	std::vector<const char *> files;
+	SDL_Surface  * target;
+	SDL_Renderer * renderer;
+	Uint64		   start;
+	// --
+	for (int i = 2; i < argc; i++)
+		files.push_back(argv[i]);
+	if (files.size() == 0)
+		files.assign(defaults, defaults + sizeof(defaults) / sizeof(defaults[0]));
+	if (IMG_Init(IMG_INIT_PNG) != IMG_INIT_PNG) {
+		std::cout << "IMG_Init Error: " << IMG_GetError() << std::endl;
+		return 1;
+	}
+	target	 = SDL_CreateRGBSurfaceWithFormat(0, 64, 64, 32, SDL_PIXELFORMAT_ARGB8888);
+	renderer = SDL_CreateSoftwareRenderer(target);
+
+	start = SDL_GetPerformanceCounter();
+	for (int i = 0; i < files.size(); i++)
+		SDL_DestroyTexture(loadSpriteSheet(renderer, files[i]));
+	std::cout << "assets: " << files.size() << " images, one by one " << (1000.0 * (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency()) << " ms" << std::endl;
+
+	for (int run = 0; run < 3; run++) {
+		assetLoader loader;
+		loader.useCache = (run > 0);
+		for (int i = 0; i < files.size(); i++)
+			loader.request(files[i]);
+		start = SDL_GetPerformanceCounter();
+		loader.start(SDL_GetCPUCount());
+		loader.finish(renderer);
+		std::cout << "assets: " << files.size() << " images, " << runs[run] << " " << (1000.0 * (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency()) << " ms ("
+				  << loader.fromCache << " from cache, " << loader.decoded << " decoded, " << loader.failed << " failed)" << std::endl;
+		for (int i = 0; i < files.size(); i++)
+			SDL_DestroyTexture(loader.texture(i));
+	}
+
+	SDL_DestroyRenderer(renderer);
+	SDL_FreeSurface(target);
+	IMG_Quit();
+	return 0;
+}
+
 int main(int argc, char** argv) {
+#ifdef COUNT_ALLOCATIONS
+	Uint64 launchTime = SDL_GetPerformanceCounter();
+#endif
 	SDL_Event event;
 	SDL_DisplayMode displayMode;
+	const char * trackFile = NULL,
+			   * recordFile = NULL;
+	Uint32		 endlessSeed = 0,
+				 seed = time(NULL);
+	replayFile	 replay;
+	bool		 replaying = false;
+	int			 numPlayers = 1;
 	
+#ifndef ATLAS
+	if ((argc > 1) && (strcmp(argv[1], "--pack-atlas") == 0))
+		return packAtlas((argc > 2) ? atoi(argv[2]) : 4096);
+#endif
+	if ((argc > 2) && (strcmp(argv[1], "--compile-track") == 0))
+		return compileTrack(argv[2], (argc > 3) ? atoi(argv[3]) : 1, (argc > 4) ? atoi(argv[4]) : 0);
+	if ((argc > 1) && (strcmp(argv[1], "--bench-sprites") == 0))
+		return benchSprites();
+	if ((argc > 1) && (strcmp(argv[1], "--bench-road") == 0))
+		return benchRoad();
+	if ((argc > 1) && (strcmp(argv[1], "--bench-fog") == 0))
+		return benchFog();
+	if ((argc > 1) && (strcmp(argv[1], "--benchmark") == 0))
+		return benchGame(argc, argv);
+	if ((argc > 1) && (strcmp(argv[1], "--bench-assets") == 0))
+		return benchAssets(argc, argv);
+	if ((argc > 1) && (strcmp(argv[1], "--bench-raster") == 0))
+		return benchRaster();
+	if ((argc > 1) && (strcmp(argv[1], "--bench-projection") == 0))
+		return benchProjection();
+	if ((argc > 2) && (strcmp(argv[1], "--verify-replay") == 0))
+		return verifyReplay(argv[2]);
+	if ((argc > 1) && (strcmp(argv[1], "--bench-traffic") == 0))
+		return benchTraffic((argc > 2) ? atoi(argv[2]) : totalCars, (argc > 3) ? atoi(argv[3]) : 0);
+
+	// The game options combine in any order, e.g. --players 2 --track file --draw-distance 1000
+	for (int i = 1; i < argc; i++) {
+		if 		((strcmp(argv[i], "--tick-rate") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) > 0)) dt = 1.0 / atoi(argv[++i]);
+		else if ((strcmp(argv[i], "--fog-density") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) >= 0)) fogDensity = atoi(argv[++i]);
+		else if ((strcmp(argv[i], "--draw-distance") == 0) && (i + 1 < argc)) drawDistance = max(2, atoi(argv[++i]));
+		else if ((strcmp(argv[i], "--track")   == 0) && (i + 1 < argc)) trackFile  = argv[++i];
+		else if ((strcmp(argv[i], "--record")  == 0) && (i + 1 < argc)) recordFile = argv[++i];
+		else if ((strcmp(argv[i], "--players") == 0) && (i + 1 < argc)) numPlayers = min(MAX_VIEWS, max(1, atoi(argv[++i])));
+		else if ((strcmp(argv[i], "--replay")  == 0) && (i + 1 < argc)) {
+			if (replay.load(argv[++i]) == false)
+				return 1;
+			replaying = true;
+		}
+		else if ((strcmp(argv[i], "--ghost")   == 0) && (i + 1 < argc)) {
+			if (ghosts.add(argv[++i]) == false)
+				return 1;
+		}
+		else if  (strcmp(argv[i], "--endless") == 0)
+			endlessSeed = ((i + 1 < argc) && (atoi(argv[i + 1]) > 0)) ? atoi(argv[++i]) : time(NULL);
+	}
+	if ((endlessSeed != 0) && ((trackFile != NULL) || (ghosts.size() > 0))) {
+		std::cout << "The endless road is generated, it can't be combined with a track or ghosts" << std::endl;
+		return 1;
+	}
+
 	if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
     	std::cout << "SDL_Init Error: " << SDL_GetError() << std::endl;
     	return 1;
@@ -815,6 +5287,18 @@ int main(int argc, char** argv) {
     	std::cout << "IMG_Init Error: " << IMG_GetError() << std::endl;
     	return 1;
   	}
+
+	// -- Images decode in the background while the window opens and the track is built
+	assetLoader assets;
+	int spritesAsset	 = assets.request(SPRITES_FILE),
+		backgroundsAsset = (strcmp(BACKGROUNDS_FILE, SPRITES_FILE) == 0) ? spritesAsset : assets.request(BACKGROUNDS_FILE),
+		fontAssets[NUM_FONTS];
+	for (int i = 0; i < NUM_FONTS; i++)
+		fontAssets[i] = assets.request(fontFiles[i].filename);
+	assets.start(SDL_GetCPUCount());
+
+	// -- Music starts while the rest loads, the game goes on silent without an audio device
+	audio.open();
   	  	
 	SDL_Window *win = SDL_CreateWindow("Prueba", 100, 100, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
   	if (win == NULL) {
@@ -837,12 +5321,10 @@ int main(int argc, char** argv) {
 	}
 #endif
 
-	srand (time(NULL));
-  	
 	int speed 		= 0;
 	int x, y;
-    int startPosition, 
-		position 	= 0;
+    int position 	= 0,
+		previousPosition = 0;
 	bool touchUp 	= false, 
 		 touchLeft	= false, 
 		 touchRight	= false,
@@ -850,45 +5332,91 @@ int main(int argc, char** argv) {
  	float skyOffset = 0,
 	 	  hillOffset= 0, 
 		  treeOffset= 0;
-	unsigned int lastTime = 0, currentTime;		  
+	float previousPlayerX = playerX,
+		  accumulator = 0,
+		  alpha;
+	Uint64	lastTime, currentTime;		  
+	SDL_RendererInfo rendererInfo;
+	Uint64	frameStart;
+	bool	quit		 = false;
+	int		fastForward	 = 1;
+	cameraView	views[MAX_VIEWS];
+	localPlayer	rivals[MAX_VIEWS];
+#ifdef COUNT_ALLOCATIONS
+	unsigned long lastAllocations = 0;
+	Uint64	renderStart, renderTime = 0;
+	int 	renderFrames = 0;
+	bool	firstFrame	 = true;
+#endif
 
-//////////////////////////////////////////////////////////////////////////////////
-	spriteFont sFont(ren, "./images/font/speedFont.png", 9, 14);
-//////////////////////////////////////////////////////////////////////////////////
+	SDL_GetRendererInfo(ren, &rendererInfo);
 		  
-	Segment playerSegment;
-		  
-	resetRoad();
-    resetSprites();
-	resetCars();
+	// -- A replay brings its own world and tick length, so do ghosts, a recording starts from the one built here
+#ifdef COUNT_ALLOCATIONS
+	Uint64 loadStart = SDL_GetPerformanceCounter();
+#endif
+	if (ghosts.size() > 0) {
+		seed	  = ghosts.header(0).seed;
+		trackFile = (ghosts.header(0).track[0] != '\0') ? ghosts.header(0).track : NULL;
+		dt		  = ghosts.header(0).tickLength;
+	}
+	if (replaying == true) {
+		if (replay.buildWorld() == false)
+			return 1;
+	} else if (buildWorld(seed, endlessSeed, trackFile) == false)
+		return 1;
+	// The projection reads the curve prefix sums one lap ahead at most, a short track can't be drawn further
+	if (drawDistance > (int)segments.size()) {
+		std::cout << "draw distance clamped to the " << segments.size() << " segments of the track" << std::endl;
+		drawDistance = segments.size();
+	}
+#ifdef COUNT_ALLOCATIONS
+	if ((replaying == false) && (trackFile != NULL))
+		std::cout << "track: " << segments.size() << " segments loaded in " << (1000.0 * (SDL_GetPerformanceCounter() - loadStart) / SDL_GetPerformanceFrequency()) << " ms" << std::endl;
+#endif
+	if ((recordFile != NULL) && (replay.start(seed, endlessSeed, trackFile) == false))
+		return 1;
+	trafficPool.start(SDL_GetCPUCount());
+	// -- Split screen: the other players start spread around the track, each with a camera
+	if ((numPlayers > 1) && (endless.enabled == true)) {
+		std::cout << "Split screen needs a fixed track, the endless road is only built ahead of the player" << std::endl;
+		return 1;
+	}
+	for (int v = 1; v < numPlayers; v++)
+		rivals[v].start((long long)trackLength * v / numPlayers);
+	splitScreen(views, numPlayers, SCREEN_WIDTH, SCREEN_HEIGHT);
 	
-	SDL_Texture * spriteSheet = loadSpriteSheet(ren, "sprites.png");
+	assets.finish(ren);
+#ifdef COUNT_ALLOCATIONS
+	std::cout << "assets: " << assets.fromCache << " from cache, " << assets.decoded << " decoded, ready after " << (1000.0 * (SDL_GetPerformanceCounter() - launchTime) / SDL_GetPerformanceFrequency()) << " ms" << std::endl;
+#endif
+
+	SDL_Texture * spriteSheet = assets.texture(spritesAsset);
   	if (spriteSheet == NULL) {
     	std::cout << "SpriteSheet not loaded" << std::endl;
     	return 1;
   	}
 
-	SDL_Texture * backgrounds = loadSpriteSheet(ren, "background.png");
+	SDL_Texture * backgrounds = assets.texture(backgroundsAsset);
   	if (backgrounds == NULL) {
     	std::cout << "backgrounds not loaded" << std::endl;
     	return 1;
   	}
-		
-    while(1) {
-    	    	
-		startPosition = position;
-			
-		position = position + dt * speed;
-		while (position >= trackLength) position -= trackLength;
-		while (position < 0) position += trackLength;	
-
-		updateCars(position, speed);
-		updateBackgrounds(startPosition, position, &skyOffset, &hillOffset, &treeOffset);
 
+//////////////////////////////////////////////////////////////////////////////////
+	spriteFont * fonts[NUM_FONTS];
+	for (int i = 0; i < NUM_FONTS; i++)
+		fonts[i] = new spriteFont(assets.texture(fontAssets[i]), fontFiles[i].sideX, fontFiles[i].sideY, fontFiles[i].glyphs);
+//////////////////////////////////////////////////////////////////////////////////
+		
+	lastTime = SDL_GetPerformanceCounter();
+    while (quit == false) {
+		frameStart = SDL_GetPerformanceCounter();
+		phaseTimer timer(PHASE_INPUT);
 		// -- Check keyboard
     	while (SDL_PollEvent(&event) != 0) {
-        	if (event.type == SDL_QUIT) 
-            	return SDL_TRUE;
+        	if (event.type == SDL_QUIT)
+				quit = true;
         	else if (event.type == SDL_WINDOWEVENT) {
             	//Window resize/orientation change
             	if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)	{
@@ -903,7 +5431,21 @@ int main(int argc, char** argv) {
 	        		case SDLK_RIGHT:	touchRight 	= true;		break;
 	        		case SDLK_UP:		touchUp 	= true;		break;
 	        		case SDLK_DOWN:		touchDown 	= true;		break;
+	        		case SDLK_F2:
+	        			for (int v = MAX_VIEWS - 1; v >= 0; v--)
+	        				views[v].road.batched = views[v].sprites.batched = !views[0].road.batched;
+	        			break;
+	        		case SDLK_F3:		fogDensity = max(0, fogDensity - 1);			break;
+	        		case SDLK_F4:		fogDensity = fogDensity + 1;					break;
+	        		case SDLK_F5:		profiler.enable(!profiler.enabled);				break;
+	        		case SDLK_F6:
+	        			if (profiler.exportTrace("profile.json") == true)
+	        				std::cout << "profile: written to profile.json" << std::endl;
+	        			break;
+	        		case SDLK_F7:		if (replaying == true) fastForward = (fastForward == 1) ? 8 : 1;	break;
 	    		}
+	    		for (int v = 1; v < numPlayers; v++)
+	    			rivals[v].press(v, event.key.keysym.sym, true);
 	    	}
 			else if (event.type == SDL_KEYUP) {
 			    switch (event.key.keysym.sym)  {
@@ -912,6 +5454,8 @@ int main(int argc, char** argv) {
 	        		case SDLK_UP:		touchUp 	= false;	break;
 	        		case SDLK_DOWN:		touchDown 	= false;	break;
 	    		}	    		
+	    		for (int v = 1; v < numPlayers; v++)
+	    			rivals[v].press(v, event.key.keysym.sym, false);
 	    	}
 #else
 			else if (event.type == SDL_FINGERDOWN) {
@@ -946,84 +5490,109 @@ int main(int argc, char** argv) {
         	}
 #endif			
     	}	
+		timer.stop();
 
-#ifdef _WIN32 						
-		if (touchUp 	== true) speed = speed + (accel * dt);
-		if (touchDown 	== true) speed = speed + (breaking * dt);
-		if ((touchUp 	== false) && (touchDown == false)) speed = speed + (decel * dt);
-#else
-		if (touchDown == false) 
-			speed = speed + (accel * dt);
-		else
-			speed = speed + (breaking * dt);
-#endif
-		if (touchLeft 	== true) playerX = playerX - (dt * 2.0 * (float)speed/(float)maxSpeed);
-		if (touchRight 	== true) playerX = playerX + (dt * 2.0 * (float)speed/(float)maxSpeed);
-		// -- Speed limited
-    	if (speed < 0) speed = 0;
-    	if (speed > maxSpeed) speed = maxSpeed;
-    	// X axis movement limited
-    	if (playerX > 3) playerX = 3;
-    	if (playerX < -3) playerX = -3;	
-    	
-    	playerX = playerX - ((dt * 2.0 * (float)speed/(float)maxSpeed) * ((float)speed/(float)maxSpeed) * findSegment(position+playerZ).curve * centrifugal);
+		// -- Simulation, in fixed steps of dt whatever the frame rate. F7 fast-forwards a replay,
+		// simulating eight times the time passed and still drawing once.
+		currentTime  = SDL_GetPerformanceCounter();
+		accumulator += fastForward * (float)(currentTime - lastTime) / (float)SDL_GetPerformanceFrequency();
+		lastTime	 = currentTime;
+		if (accumulator > fastForward * maxFrameTime) accumulator = fastForward * maxFrameTime;
+		while ((accumulator >= dt) && (quit == false)) {
+			accumulator 	-= dt;
+			previousPosition = position;
+			previousPlayerX	 = playerX;
+			if (replaying == true)
+				quit = !replay.play(position, speed, &touchUp, &touchDown, &touchLeft, &touchRight);
+			else if (recordFile != NULL)
+				replay.record(position, speed, touchUp, touchDown, touchLeft, touchRight);
+			if (quit == false) {
+				update(&position, &speed, touchUp, touchDown, touchLeft, touchRight, &skyOffset, &hillOffset, &treeOffset);
+				for (int v = 1; v < numPlayers; v++)
+					rivals[v].update();
+				ghosts.advance();
+			}
+		}
 
-		playerSegment = findSegment(position + playerZ);
-		
-		// Car in offroad X position
-		if ((playerX < -1) || (playerX > 1)) {
-			// Decelerate to offroad speed
-        	if (speed > offRoadLimit)
-          		speed = speed + (offRoadDecel * dt);
-          	// Check collision with offroad objects
-			for (int j = startPosition; j <= position; j++) {
-				playerSegment = findSegment(j + playerZ);
-	            for (int i = 0; i < playerSegment.sprites.size(); i++) {
-	          		if (collision(playerX,  PLAYER_STRAIGHT_SPRITE.w * scaleSprites, playerSegment.sprites[i].x_offset + (playerSegment.sprites[i].spriteRect.w * scaleSprites)/2 * (playerSegment.sprites[i].x_offset > 0 ? 1 : -1), playerSegment.sprites[i].spriteRect.w * scaleSprites, 1.0)) {
-	            		speed = maxSpeed / 5;
-						position = playerSegment.p1worldZ - playerZ;
-						while (position >= trackLength)	 position -= trackLength;
-						while (position <  0)	 		 position += trackLength;
-	            		break;
-	        		}
-	        	}
-	    	}
-      	}
-	  	// Check collision with other cars
-		for (int j = startPosition; j <= position; j++) {
-			playerSegment = findSegment(j + playerZ);
-			for (int i = 0; i < playerSegment.cars.size(); i++) {
-	        	if (speed > playerSegment.cars[i].speed) {
-					if (collision(playerX, PLAYER_STRAIGHT_SPRITE.w * scaleSprites, playerSegment.cars[i].x_offset, playerSegment.cars[i].spriteRect.w * scaleSprites, 0.8)) {
-						speed    = playerSegment.cars[i].speed * (playerSegment.cars[i].speed / speed);
-						position = playerSegment.cars[i].z_offset - playerZ;
-						while (position >= trackLength)	 position -= trackLength;
-						while (position <  0)	 		 position += trackLength;
-	            		break;            		
-	          		}
-	        	}
-	      	}			
+		// -- Render in between the last two ticks, one camera per player
+		alpha = accumulator / dt;
+		views[0].position	= renderedPosition(previousPosition, position, alpha);
+		views[0].playerX	= previousPlayerX + (playerX - previousPlayerX) * alpha;
+		views[0].speed		= speed;
+		views[0].steer		= touchRight - touchLeft;
+		views[0].skyOffset	= skyOffset;	views[0].hillOffset	= hillOffset;	views[0].treeOffset	= treeOffset;
+		for (int v = 1; v < numPlayers; v++) {
+			views[v].position	= renderedPosition(rivals[v].previousPosition, rivals[v].position, alpha);
+			views[v].playerX	= rivals[v].previousX + (rivals[v].x - rivals[v].previousX) * alpha;
+			views[v].speed		= rivals[v].speed;
+			views[v].steer		= rivals[v].touchRight - rivals[v].touchLeft;
+			views[v].skyOffset	= rivals[v].skyOffset;	views[v].hillOffset	= rivals[v].hillOffset;	views[v].treeOffset	= rivals[v].treeOffset;
 		}
-	
+
 		SDL_SetRenderDrawColor(ren, SKY_COLOR.r, SKY_COLOR.g, SKY_COLOR.b, SKY_COLOR.a);	
 		SDL_RenderClear(ren);
 
-		render(ren, position, spriteSheet, speed, touchLeft, touchRight, backgrounds, skyOffset, hillOffset, treeOffset);
+#ifdef COUNT_ALLOCATIONS
+		renderStart = SDL_GetPerformanceCounter();
+#endif
+		renderViews(ren, views, numPlayers, alpha, spriteSheet, backgrounds);
+#ifdef COUNT_ALLOCATIONS
+		renderTime += SDL_GetPerformanceCounter() - renderStart;
+		// -- Frame time of the road renderer in use (F2 switches between batched and line by line)
+		if (++renderFrames == 100) {
+			std::cout << "render (" << (views[0].road.batched ? "batched road" : "line by line road") << "): " << (1000.0 * renderTime / SDL_GetPerformanceFrequency()) / renderFrames << " ms/frame" << std::endl;
+			unsigned long total = heapAllocations();
+			std::cout << "heap: " << (total - lastAllocations) / renderFrames << " allocations/frame" << std::endl;
+			lastAllocations = total;
+			renderTime 	 = 0;
+			renderFrames = 0;
+		}
+#endif
     
 /////////////////////////////////////////////////////////////////////////
-    	sFont.print(ren, 100, 100, 120, 120, SSTR(speed/60));
+		for (int v = 0; v < numPlayers; v++)
+    		fonts[FONT_SPEED]->print(ren, views[v].viewport.x + 100, views[v].viewport.y + 100, 120, 120, hudText() << views[v].speed / 60);
 /////////////////////////////////////////////////////////////////////////    
+		// -- F5 shows the last frames broken down by phase, F6 saves them as a Chrome trace
+		if (profiler.enabled == true)
+			profiler.render(ren, *fonts[FONT_BLUE], 10, 10);
+		for (int i = 0; i < NUM_FONTS; i++)
+			profiler.drawCalls += fonts[i]->flush(ren);
     
+		// Presenting waits for the display refresh
+		timer.next(PHASE_PRESENT);
 		SDL_RenderPresent(ren);
-		
-		currentTime = SDL_GetTicks() - lastTime;
-        if (currentTime < (1000 * dt)) SDL_Delay( (1000 * dt) - currentTime);
-        lastTime = SDL_GetTicks();
-	
+		timer.stop();
+		profiler.endFrame(SDL_GetPerformanceCounter() - frameStart);
+#ifdef COUNT_ALLOCATIONS
+		if (firstFrame == true) {
+			std::cout << "first frame after " << (1000.0 * (SDL_GetPerformanceCounter() - launchTime) / SDL_GetPerformanceFrequency()) << " ms" << std::endl;
+			firstFrame = false;
+		}
+#endif
+		// Without vsync yield a bit instead of spinning
+		if ((rendererInfo.flags & SDL_RENDERER_PRESENTVSYNC) == 0)
+			SDL_Delay(1);
 	}
 
-	SDL_DestroyTexture(backgrounds);
+	if ((recordFile != NULL) && (replay.save(recordFile) == true))
+		std::cout << "replay: " << replay.tick << " ticks written to " << recordFile << std::endl;
+	if (replaying == true) {
+		std::cout << "replay: " << replay.tick << " ticks, " << replay.keyframes << " keyframes, ";
+		if (replay.diverged < 0)
+			std::cout << "no divergence" << std::endl;
+		else
+			std::cout << "diverged at tick " << replay.diverged << std::endl;
+	}
+	trafficPool.stop();
+	viewPool.stop();
+	ghosts.clear();
+	if (backgrounds != spriteSheet)
+		SDL_DestroyTexture(backgrounds);
 	SDL_DestroyTexture(spriteSheet);
+	for (int i = 0; i < NUM_FONTS; i++)
+		delete fonts[i];
+	audio.close();
 	
 	SDL_DestroyRenderer(ren);
   	SDL_DestroyWindow(win);